@@ -58,10 +58,10 @@ const uint8_t mask_fdc_write_protect = 0x40;
 const uint8_t mask_extended_data = 0x40; // mask for checking FDC status extended data bit
 const uint8_t mask_reserved = 0x80;
 
-uint8_t atx_track_size[4]; // number of sectors in each track
-uint8_t atx_density[4];
-uint32_t gTrackInfo[4][max_track]; // pre-calculated info for each track
-uint8_t gCurrentHeadTrack[4];
+uint8_t atx_track_size[DRIVE_COUNT]; // number of sectors in each track
+uint8_t atx_density[DRIVE_COUNT];
+uint32_t gTrackInfo[DRIVE_COUNT][max_track]; // pre-calculated info for each track
+uint8_t gCurrentHeadTrack[DRIVE_COUNT];
 
 typedef struct {
 	absolute_time_t stamp;
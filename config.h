@@ -20,10 +20,32 @@
 
 #define WAV_96K
 
+// The FSK tone filters of the WAV decoding. By default the Goertzel filters run
+// over the whole filter window for every sample, the decoded signal is then
+// bit for bit the same as in the earlier releases. This switches to the sliding
+// DFT filters, their cost per sample does not depend on the window size, but
+// they round differently: on synthetic 600 baud FSK recordings (22.05 to 96kHz,
+// 8 and 16-bit, with and without noise) up to 0.16% of the samples came out
+// different after the averaging, the signal edges moved by up to 8 samples and
+// up to 1.6% of them had no counterpart. With WAV_FILTER_CHECK the Goertzel
+// filters run next to the sliding ones and the statistics screen shows how many
+// samples of the last WAV file came out different. Either way the statistics
+// screen shows the core0 load of the decoding, it has to stay under 50%.
+
+//#define WAV_SLIDING_TONE_FILTERS
+//#define WAV_FILTER_CHECK
+
 // Use the PIO based emulated disk rotational counter for the ATX support
 // (This is more of a PIO programming exercise rather than anything else)
 //#define PIO_DISK_COUNTER
 
+// Tape timing calibration, the About screen then runs it with the Y button.
+// A test pattern of all the pulse kinds is played (with the tape stopped) to the
+// SIO data in and the turbo data pins, a state machine on the second PIO block
+// measures the pulses on the pins and the error distribution per pulse kind is
+// shown. The Atari should not be reading anything from the tape meanwhile.
+//#define TAPE_CALIBRATION
+
 // Give core1 more computing priority (not really needed)
 //#define CORE1_PRIORITY
 
@@ -34,15 +56,129 @@
 
 //#define FULL_SPEED_PIO
 
-// Additional delay for emulating the motor stopping and starting lag (applies
-// to WAV files only). This was introduced in the attempt to make some "senstive"
-// WAV files to load better, but in the end it does not seem to have much effect,
-// left here for possible future use. Value 0 means no delay, otherwise both
-// are in 10ms units of time (defined by MOTOR_CHECK_INTERVAL_MS in io.hpp) to
-// define the delay.
-
-#define MOTOR_OFF_DELAY 0 // 500 ms
-#define MOTOR_ON_DELAY 0 // 500 ms
+// Additional delay for emulating the motor stopping and starting lag. This was
+// introduced in the attempt to make some "senstive" WAV files to load better,
+// but in the end it does not seem to have much effect, left here for possible
+// future use. Value 0 means no delay (the tape stops and starts right at the
+// motor line edge), otherwise both are in ms.
+
+#define MOTOR_OFF_DELAY 0 // 500
+#define MOTOR_ON_DELAY 0 // 500
+
+// The board type (RASPBERRYPI_PICO2) for the buffer sizes below. The Pico 1
+// has 264KB of RAM, with the defaults the static buffers take about 90KB of it
+// (about 115KB on the Pico 2, plus the RAM arena), the display frame buffer
+// another 38KB.
+
+#include "pico.h"
+
+// Number of emulated disk drives, 4 to 15 (D1: to D9:, then DJ: to DO:, the
+// SpartaDOS way). The main screen shows the drives in banks of 4, the B button
+// on the rotate entries flips through the banks, rotation goes over all the
+// drives. Each drive costs roughly the mount path (MAX_PATH_LEN), the ATX track
+// table, and on the Pico 2 the 512 byte buffer of the file object. On the Pico 1
+// the file objects share the sector buffer of the file system (FF_FS_TINY in
+// fatfs/ffconf.h), that costs extra media reads only when the tape and the
+// drives are read at the same time.
+
+#define DRIVE_COUNT 8
+
+// Read-ahead cache for ATR disk images. On a sequential read miss the rest
+// of the current track (18 or 26 sectors, bounded by the slot size in bytes)
+// is fetched from the media in one go, the following sector reads are then
+// served straight from memory. The slots are shared between all the drives
+// (the least recently used one is reclaimed), 0 slots disables the read-ahead.
+// Each slot takes DISK_CACHE_SLOT_SIZE bytes of RAM.
+
+#ifdef RASPBERRYPI_PICO2
+#define DISK_CACHE_SLOTS 4
+#else
+#define DISK_CACHE_SLOTS 2
+#endif
+#define DISK_CACHE_SLOT_SIZE 4608 // 18 * 256 bytes
+
+// Write-back cache for disk image (ATR and ATX) writes. Written sectors are
+// acknowledged to the Atari immediately and kept in memory, they get written
+// to the media and synced when the drives have been idle for the given time,
+// when the oldest unwritten sector reaches the maximum age, when the cache is
+// full, and on unmount, rotation, or SD card removal. The number of sectors
+// bounds the amount of data that can be lost on a sudden power cut, 0 makes
+// all the writes go straight to the media as before.
+
+#define DISK_WRITE_BACK_SECTORS 16
+#define DISK_WRITE_BACK_IDLE_MS 250
+#define DISK_WRITE_BACK_MAX_MS 2000
+
+// HSIO divisor auto-tuning (the Auto HSIO option). The command and data
+// frames received at high speed are counted per divisor, when the given
+// number of them fails within the window of frames the next slower divisor
+// is picked for the current host clock (PAL/NTSC) and remembered in the
+// configuration FLASH sector. After a window without errors the next faster
+// divisor is tried, it is kept (and saved) after a whole window without
+// errors, one error drops it again and doubles the number of clean windows
+// needed for the next try, up to the given maximum. Selecting Auto again
+// restarts the tuning from the fastest divisor.
+
+#define HSIO_AUTO_WINDOW 64
+#define HSIO_AUTO_MAX_ERRORS 3
+#define HSIO_AUTO_UP_WINDOWS_MAX 32
+
+// Boot traces. The first sectors read from an ATR image after it is mounted
+// are recorded in a small file next to the image (the image file name with
+// .TRC added), on the next mount of the same image these sectors are read into
+// a buffer ahead of time, between the SIO commands. The trace is saved once the
+// drives are idle for the given time, 0 sectors disables the tracing.
+
+#ifdef RASPBERRYPI_PICO2
+#define BOOT_TRACE_SECTORS 64
+#define BOOT_TRACE_BUFFER_SIZE 8192
+#else
+#define BOOT_TRACE_SECTORS 32
+#define BOOT_TRACE_BUFFER_SIZE 4096
+#endif
+#define BOOT_TRACE_IDLE_MS 3000
+
+// Whole image RAM disks (Pico 2 only). ATR images up to the given size are
+// loaded into a RAM arena on mount, as long as there is room left in it, and
+// are then read and written in memory. The written sectors go out to the media
+// under the same rules as the write-back cache above. The arena is shared with
+// other whole file buffers, 0 disables it.
+
+#define RAM_ARENA_SIZE (200*1024)
+#define RAM_DISK_MAX_SIZE (180*1024+16)
+
+// CAS images. The chunk headers of a CAS image are parsed into an index on
+// mount, and on the Pico 2 images up to the given size are also loaded whole
+// into the RAM arena above. The tape playback then does not wait for the media
+// at the chunk boundaries, or at all, respectively. The index also gives the
+// tape counter in playback time and the list of blocks to start the playback
+// from. Each index entry takes 20 bytes, for images with more chunks than
+// given here the index is moved to the RAM arena if there is room (Pico 2),
+// otherwise it covers only the first chunks. 0 disables the index.
+
+#define CAS_INDEX_CHUNKS 512
+#define CAS_RAM_MAX_SIZE (128*1024)
+
+// Accelerated tape mode (switched on per tape image in the block list). The
+// gaps before the standard 600 baud data records are cut down to the given
+// length and the records are sent at the given baud rate instead. Not all
+// loaders (or OS ROMs) accept the higher rate, 0 keeps the rate of the image.
+// All the other chunks are played with the exact timing.
+
+#define CAS_FAST_GAP_MS 250
+#define CAS_FAST_BAUD 0
+
+// WAV transcoding cache. When the tape with a WAV file is stopped, the file
+// is decoded once more in the background and the result is written as a CAS
+// image (fsk chunks, or pwms and pwml ones for turbo) into the hidden WAVCACHE
+// directory next to it. Further playbacks of the WAV file then go through the
+// CAS image, with the same timing every time and with the block list and the
+// tape counter. The copy is made again when the size or the time stamp of the
+// WAV file or the PAL/NTSC or WAV output options change. Stretches of the idle
+// signal longer than the given gap (in ms) start a new block.
+
+#define WAV_CACHE
+#define WAV_CACHE_GAP_MS 100
 
 // This changes colors for the device with at TFT screen that Zaxon of
 // atarionline.pl has built.
@@ -0,0 +1,719 @@
+/*
+ * This file is part of the a8-pico-sio project --
+ * An Atari 8-bit SIO drive and (turbo) tape emulator for
+ * Raspberry Pi Pico, see
+ *
+ *         https://github.com/woj76/a8-pico-sio
+ *
+ * For information on what / whose work it is based on, check the corresponding
+ * source files and the README file. This file is licensed under GNU General
+ * Public License 3.0 or later.
+ *
+ * Copyright (C) 2025 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "pico/multicore.h"
+#include "pico/time.h"
+#include "hardware/sync.h"
+
+#include "disk_cache.hpp"
+#include "mounts.hpp"
+#include "ram_arena.hpp"
+#include "file_load.hpp"
+
+volatile uint32_t disk_cache_hits = 0;
+volatile uint32_t disk_cache_misses = 0;
+
+static volatile bool write_back_sync_request = false;
+static volatile bool write_back_sync_failed = false;
+// When the oldest of the not yet written data became pending
+static uint32_t pending_first_ms;
+
+static bool ram_disk_pending();
+static bool write_back_pending();
+static void trace_discard(int drive_number);
+
+static void mark_pending() {
+	if(!ram_disk_pending() && !write_back_pending())
+		pending_first_ms = to_ms_since_boot(get_absolute_time());
+}
+
+// Runs the file write to the mounted image, the FLASH volume needs the
+// other core locked out
+static FRESULT locked_write(int drive_number, FRESULT (*write)(int, FIL *)) {
+	FIL* fil = &mounts[drive_number].fil;
+	uint vol_num = mounts[drive_number].mount_path[0] - '0';
+	uint32_t ints;
+	FRESULT f_op_stat;
+	mutex_enter_blocking(&fs_lock);
+	if(!vol_num) {
+		ints = save_and_disable_interrupts();
+		multicore_lockout_start_blocking();
+	}
+	if((f_op_stat = write(drive_number, fil)) == FR_OK)
+		f_op_stat = f_sync(fil);
+	if(!vol_num) {
+		multicore_lockout_end_blocking();
+		restore_interrupts(ints);
+	}
+	mutex_exit(&fs_lock);
+	return f_op_stat;
+}
+
+// Whole image RAM disks. ATR images up to RAM_DISK_MAX_SIZE are loaded into
+// the RAM arena on mount (if there is room), reads and writes are served from
+// memory, the written 128 byte blocks are marked in a dirty map and written
+// out on the same occasions as the write-back cache below.
+
+#define ram_disk_block_shift 7
+
+typedef struct {
+	uint8_t *data; // NULL when the drive is file backed
+	uint8_t *dirty;
+	FSIZE_t size;
+	bool pending;
+} ram_disk_type;
+
+static ram_disk_type ram_disks[DRIVE_COUNT+1];
+
+static FSIZE_t ram_disk_dirty_size(FSIZE_t size) {
+	return (((size + (1 << ram_disk_block_shift) - 1) >> ram_disk_block_shift) + 7) >> 3;
+}
+
+static bool ram_disk_pending() {
+	for(int i=1; i<=DRIVE_COUNT; i++)
+		if(ram_disks[i].pending)
+			return true;
+	return false;
+}
+
+static void ram_disk_free(int drive_number) {
+	ram_disk_type *rd = &ram_disks[drive_number];
+	ram_arena_free(rd->dirty);
+	ram_arena_free(rd->data);
+	rd->data = NULL;
+	rd->dirty = NULL;
+	rd->pending = false;
+}
+
+// Called on mount of an ATR image with both the mount and the file system lock
+// held, on any failure the drive stays file backed
+bool disk_cache_ram_load(int drive_number) {
+	FIL* fil = &mounts[drive_number].fil;
+	ram_disk_type *rd = &ram_disks[drive_number];
+	FSIZE_t size = sizeof(atr_header_type) + mounts[drive_number].status;
+	uint bytes_read;
+
+	ram_disk_free(drive_number);
+	if(size > RAM_DISK_MAX_SIZE || size > f_size(fil))
+		return false;
+	rd->data = (uint8_t *)ram_arena_alloc(size);
+	rd->dirty = (uint8_t *)ram_arena_alloc(ram_disk_dirty_size(size));
+	if(!rd->data || !rd->dirty || f_lseek(fil, 0) != FR_OK ||
+			f_read(fil, rd->data, size, &bytes_read) != FR_OK || bytes_read != size) {
+		ram_disk_free(drive_number);
+		return false;
+	}
+	memset(rd->dirty, 0, ram_disk_dirty_size(size));
+	rd->size = size;
+	return true;
+}
+
+bool disk_cache_ram_transfer(int drive_number, FSIZE_t offset, FSIZE_t size, bool op_write, uint8_t *data, FSIZE_t brpt) {
+	ram_disk_type *rd = &ram_disks[drive_number];
+	if(!rd->data || offset + size*brpt > rd->size)
+		return false;
+	if(!op_write) {
+		memcpy(data, &rd->data[offset], size);
+		return true;
+	}
+	mark_pending();
+	for(uint i=0; i<brpt; i++)
+		memcpy(&rd->data[offset+i*size], data, size);
+	for(FSIZE_t b = offset >> ram_disk_block_shift; b <= (offset+size*brpt-1) >> ram_disk_block_shift; b++)
+		rd->dirty[b >> 3] |= (1 << (b & 7));
+	rd->pending = true;
+	return true;
+}
+
+static FRESULT ram_disk_write(int drive_number, FIL *fil) {
+	ram_disk_type *rd = &ram_disks[drive_number];
+	FSIZE_t blocks = (rd->size + (1 << ram_disk_block_shift) - 1) >> ram_disk_block_shift;
+	FRESULT f_op_stat = FR_OK;
+	uint bytes_written;
+	FSIZE_t b = 0;
+	while(b < blocks && f_op_stat == FR_OK) {
+		if(!(rd->dirty[b >> 3] & (1 << (b & 7)))) {
+			b++;
+			continue;
+		}
+		// Write out the whole run of dirty blocks in one go
+		FSIZE_t e = b;
+		while(e < blocks && (rd->dirty[e >> 3] & (1 << (e & 7))))
+			e++;
+		FSIZE_t offset = b << ram_disk_block_shift;
+		FSIZE_t size = std::min(e << ram_disk_block_shift, rd->size) - offset;
+		if((f_op_stat = f_lseek(fil, offset)) == FR_OK &&
+				(f_op_stat = f_write(fil, &rd->data[offset], size, &bytes_written)) == FR_OK &&
+				bytes_written != size)
+			f_op_stat = FR_INT_ERR;
+		b = e;
+	}
+	return f_op_stat;
+}
+
+static FRESULT ram_disk_flush(int drive_number) {
+	ram_disk_type *rd = &ram_disks[drive_number];
+	if(!rd->pending)
+		return FR_OK;
+	FRESULT f_op_stat = locked_write(drive_number, ram_disk_write);
+	// On failure the drive gets unmounted anyhow
+	memset(rd->dirty, 0, ram_disk_dirty_size(rd->size));
+	rd->pending = false;
+	if(f_op_stat != FR_OK)
+		set_last_access_error(drive_number);
+	return f_op_stat;
+}
+
+#if DISK_WRITE_BACK_SECTORS > 0
+
+#define write_back_entry_size 512
+
+typedef struct {
+	int drive_number;
+	FSIZE_t offset;
+	FSIZE_t size;
+	uint8_t data[write_back_entry_size];
+} write_back_entry_type;
+
+static write_back_entry_type write_back[DISK_WRITE_BACK_SECTORS];
+static volatile int write_back_count = 0;
+
+static bool write_back_pending() {
+	return write_back_count;
+}
+
+static bool overlaps(write_back_entry_type *e, int drive_number, FSIZE_t offset, FSIZE_t size) {
+	return e->drive_number == drive_number && offset < e->offset + e->size && e->offset < offset + size;
+}
+
+static FRESULT write_back_write(int drive_number, FIL *fil) {
+	FRESULT f_op_stat = FR_OK;
+	uint bytes_written;
+	for(int i=0; i<write_back_count && f_op_stat == FR_OK; i++) {
+		write_back_entry_type *e = &write_back[i];
+		if(e->drive_number != drive_number)
+			continue;
+		if((f_op_stat = f_lseek(fil, e->offset)) == FR_OK &&
+				(f_op_stat = f_write(fil, e->data, e->size, &bytes_written)) == FR_OK &&
+				bytes_written != e->size)
+			f_op_stat = FR_INT_ERR;
+	}
+	return f_op_stat;
+}
+
+static void write_back_discard(int drive_number);
+
+// Writes out all pending sectors of the drive and syncs the file
+static FRESULT write_back_flush(int drive_number) {
+	int i;
+	for(i=0; i<write_back_count; i++)
+		if(write_back[i].drive_number == drive_number)
+			break;
+	if(i == write_back_count)
+		return FR_OK;
+	FRESULT f_op_stat = locked_write(drive_number, write_back_write);
+	// On failure the data is lost anyhow, the drive gets unmounted
+	if(f_op_stat != FR_OK)
+		set_last_access_error(drive_number);
+	write_back_discard(drive_number);
+	return f_op_stat;
+}
+
+static void write_back_discard(int drive_number) {
+	int j = 0;
+	for(int i=0; i<write_back_count; i++)
+		if(write_back[i].drive_number != drive_number) {
+			if(i != j)
+				write_back[j] = write_back[i];
+			j++;
+		}
+	write_back_count = j;
+}
+
+// Makes sure nothing that is cached overlaps with the given region of the file
+// before it is accessed directly
+FRESULT disk_cache_write_back_prepare(int drive_number, FSIZE_t offset, FSIZE_t size) {
+	for(int i=0; i<write_back_count; i++)
+		if(overlaps(&write_back[i], drive_number, offset, size))
+			return disk_cache_flush(drive_number);
+	return FR_OK;
+}
+
+bool disk_cache_write(int drive_number, FSIZE_t offset, FSIZE_t size, uint8_t *data) {
+	int i;
+	if(size > write_back_entry_size)
+		return false;
+	for(i=0; i<write_back_count; i++) {
+		write_back_entry_type *e = &write_back[i];
+		if(e->drive_number == drive_number && e->offset == offset && e->size == size) {
+			memcpy(e->data, data, size);
+			return true;
+		}
+		if(overlaps(e, drive_number, offset, size)) {
+			if(disk_cache_flush(drive_number) != FR_OK)
+				return false;
+			break;
+		}
+	}
+	if(write_back_count == DISK_WRITE_BACK_SECTORS && disk_cache_flush(-1) != FR_OK)
+		return false;
+	mark_pending();
+	write_back_entry_type *e = &write_back[write_back_count];
+	e->drive_number = drive_number;
+	e->offset = offset;
+	e->size = size;
+	memcpy(e->data, data, size);
+	write_back_count++;
+	return true;
+}
+
+bool disk_cache_read_back(int drive_number, FSIZE_t offset, FSIZE_t size, uint8_t *data) {
+	for(int i=0; i<write_back_count; i++) {
+		write_back_entry_type *e = &write_back[i];
+		if(e->drive_number == drive_number && e->offset == offset && e->size == size) {
+			memcpy(data, e->data, size);
+			return true;
+		}
+	}
+	return false;
+}
+
+#else
+
+static bool write_back_pending() { return false; }
+static FRESULT write_back_flush(int drive_number) { return FR_OK; }
+static void write_back_discard(int drive_number) {}
+FRESULT disk_cache_write_back_prepare(int drive_number, FSIZE_t offset, FSIZE_t size) { return FR_OK; }
+bool disk_cache_write(int drive_number, FSIZE_t offset, FSIZE_t size, uint8_t *data) { return false; }
+bool disk_cache_read_back(int drive_number, FSIZE_t offset, FSIZE_t size, uint8_t *data) { return false; }
+
+#endif
+
+// Writes out everything pending for the drive (-1 for all of them), the caller
+// holds the mount lock, but not the file system one
+FRESULT disk_cache_flush(int drive_number) {
+	FRESULT f_op_stat = FR_OK, r;
+	if(drive_number < 0) {
+		for(int i=1; i<=DRIVE_COUNT; i++)
+			if((r = disk_cache_flush(i)) != FR_OK)
+				f_op_stat = r;
+		return f_op_stat;
+	}
+	f_op_stat = ram_disk_flush(drive_number);
+	if((r = write_back_flush(drive_number)) != FR_OK)
+		f_op_stat = r;
+	if(f_op_stat != FR_OK)
+		write_back_sync_failed = true;
+	return f_op_stat;
+}
+
+// Drops the pending data and the RAM disk of the drive, only for when the
+// media is gone or failed
+void disk_cache_discard(int drive_number) {
+	write_back_discard(drive_number);
+	ram_disk_free(drive_number);
+	trace_discard(drive_number);
+}
+
+// Writes out the pending data of the drive (there should not be any left, core
+// 0 syncs before it closes the file) and gives the RAM disk back, on (re-)mount
+// or unmount
+FRESULT disk_cache_release(int drive_number) {
+	FRESULT f_op_stat = disk_cache_flush(drive_number);
+	ram_disk_free(drive_number);
+	trace_discard(drive_number);
+	return f_op_stat;
+}
+
+// Reads the data straight from the file, past the RAM disk and the write-back
+// cache, for the write verify
+FRESULT disk_cache_read_media(int drive_number, FSIZE_t offset, FSIZE_t size, uint8_t *data) {
+	FIL* fil = &mounts[drive_number].fil;
+	FRESULT f_op_stat;
+	uint bytes_read;
+	mutex_enter_blocking(&fs_lock);
+	if((f_op_stat = f_lseek(fil, offset)) == FR_OK &&
+			(f_op_stat = f_read(fil, data, size, &bytes_read)) == FR_OK && bytes_read != size)
+		f_op_stat = FR_INT_ERR;
+	mutex_exit(&fs_lock);
+	return f_op_stat;
+}
+
+// Called from the SIO loop, the caller holds the mount lock
+void disk_cache_idle() {
+	if(!ram_disk_pending() && !write_back_pending()) {
+		write_back_sync_request = false;
+		return;
+	}
+	uint32_t t = to_ms_since_boot(get_absolute_time());
+	if(write_back_sync_request || t - last_drive_access > DISK_WRITE_BACK_IDLE_MS ||
+			t - pending_first_ms > DISK_WRITE_BACK_MAX_MS) {
+		disk_cache_flush(-1);
+		write_back_sync_request = false;
+	}
+}
+
+bool disk_cache_dirty() {
+	return ram_disk_pending() || write_back_pending() || write_back_sync_request;
+}
+
+// Core 0 asks core 1 to write out everything pending, only core 1 writes to
+// the media (so that the FLASH lockout works), and waits for it to do so for
+// as long as it takes
+static bool disk_cache_sync() {
+	write_back_sync_failed = false;
+	write_back_sync_request = true;
+	while(write_back_sync_request)
+		tight_loop_contents();
+	return !write_back_sync_failed;
+}
+
+// Called from core 0 before it closes any of the mounted files, takes the
+// mount lock with nothing pending, while it is held core 1 cannot take in any
+// new writes. On false some of the data did not make it, the lock is not held,
+// the failing drive is then unmounted by core 1 and the file should be left
+// alone.
+bool disk_cache_sync_lock() {
+	mutex_enter_blocking(&mount_lock);
+	while(ram_disk_pending() || write_back_pending()) {
+		mutex_exit(&mount_lock);
+		if(!disk_cache_sync())
+			return false;
+		mutex_enter_blocking(&mount_lock);
+	}
+	return true;
+}
+
+// File offset (relative to the ATR header end) of the given sector
+static FSIZE_t atr_sector_offset(int drive_number, uint sector_number) {
+	FSIZE_t sec_size = disk_headers[drive_number-1].atr_header.sec_size;
+	if(sec_size == 512)
+		return (sector_number-1) << 9;
+	if(sector_number <= 3)
+		return (sector_number-1) << 7;
+	if(sec_size == 256)
+		return 384+(sector_number-4)*sec_size;
+	return (sector_number-1)*sec_size;
+}
+
+// Boot traces. The first BOOT_TRACE_SECTORS distinct sectors read from an ATR
+// image after it is mounted are recorded and saved next to the image (the
+// image file name with .TRC added). On the next mount of the same image the
+// recorded sectors are read into a buffer in the recorded order, one at a time
+// between the SIO commands, ahead of the Atari asking for them. Only the most
+// recently mounted drive is traced.
+
+#if BOOT_TRACE_SECTORS > 0
+
+static int trace_drive = 0;
+static bool trace_recording = false;
+static bool trace_prefetching = false;
+static uint16_t trace_count;
+static uint16_t trace_sectors[BOOT_TRACE_SECTORS];
+static uint16_t trace_saved_count;
+static uint16_t trace_saved_sectors[BOOT_TRACE_SECTORS];
+static uint16_t trace_loaded;
+static uint16_t trace_buffer_pos[BOOT_TRACE_SECTORS];
+static FSIZE_t trace_buffer_used;
+static uint8_t trace_buffer[BOOT_TRACE_BUFFER_SIZE];
+static FIL trace_fil;
+static char trace_path[MAX_PATH_LEN+4];
+
+static void trace_invalidate(int drive_number) {
+	if(trace_drive != drive_number)
+		return;
+	trace_prefetching = false;
+	trace_loaded = 0;
+	trace_buffer_used = 0;
+}
+
+static void trace_discard(int drive_number) {
+	if(trace_drive == drive_number)
+		trace_drive = 0;
+}
+
+static void trace_record(int drive_number, uint16_t sector_number) {
+	if(trace_drive != drive_number || !trace_recording || trace_count == BOOT_TRACE_SECTORS)
+		return;
+	for(int i=0; i<trace_count; i++)
+		if(trace_sectors[i] == sector_number)
+			return;
+	trace_sectors[trace_count++] = sector_number;
+}
+
+static bool trace_read(int drive_number, uint16_t sector_number, FSIZE_t to_read) {
+	if(trace_drive != drive_number)
+		return false;
+	for(int i=0; i<trace_loaded; i++)
+		if(trace_saved_sectors[i] == sector_number) {
+			memcpy(sector_buffer, &trace_buffer[trace_buffer_pos[i]], to_read);
+			return true;
+		}
+	return false;
+}
+
+// Called on mount of an ATR image with both the mount and the file system lock
+// held, after the RAM disk had its go
+void disk_cache_trace_mount(int drive_number) {
+	uint bytes_read;
+	size_t l = strlen(mounts[drive_number].mount_path);
+
+	trace_drive = 0;
+	if(ram_disks[drive_number].data || l + 5 > sizeof(trace_path))
+		return;
+	memcpy(trace_path, mounts[drive_number].mount_path, l);
+	strcpy(&trace_path[l], ".TRC");
+	trace_drive = drive_number;
+	trace_recording = true;
+	trace_count = 0;
+	trace_saved_count = 0;
+	trace_loaded = 0;
+	trace_buffer_used = 0;
+	if(f_open(&trace_fil, trace_path, FA_READ) == FR_OK) {
+		if(f_read(&trace_fil, &trace_saved_count, sizeof(uint16_t), &bytes_read) != FR_OK || bytes_read != sizeof(uint16_t) ||
+				trace_saved_count > BOOT_TRACE_SECTORS ||
+				f_read(&trace_fil, trace_saved_sectors, trace_saved_count*sizeof(uint16_t), &bytes_read) != FR_OK ||
+				bytes_read != trace_saved_count*sizeof(uint16_t))
+			trace_saved_count = 0;
+		f_close(&trace_fil);
+	}
+	trace_prefetching = (trace_saved_count > 0);
+}
+
+static void trace_save() {
+	uint bytes_written;
+	uint vol_num = trace_path[0] - '0';
+	uint32_t ints;
+	mutex_enter_blocking(&fs_lock);
+	if(!vol_num) {
+		ints = save_and_disable_interrupts();
+		multicore_lockout_start_blocking();
+	}
+	// Not being able to save it is not an error of the drive
+	if(f_open(&trace_fil, trace_path, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK) {
+		f_write(&trace_fil, &trace_count, sizeof(uint16_t), &bytes_written);
+		f_write(&trace_fil, trace_sectors, trace_count*sizeof(uint16_t), &bytes_written);
+		f_close(&trace_fil);
+	}
+	if(!vol_num) {
+		multicore_lockout_end_blocking();
+		restore_interrupts(ints);
+	}
+	mutex_exit(&fs_lock);
+}
+
+bool disk_cache_trace_busy() {
+	return trace_drive && ((trace_prefetching && trace_loaded < trace_saved_count) || (trace_recording && trace_count));
+}
+
+// Called from the SIO loop when there is no command to serve, the caller holds
+// the mount lock. Prefetches one more sector of the saved trace, or, once the
+// drive has been idle for a while, saves the new trace if it is different.
+void disk_cache_trace_step() {
+	int drive_number = trace_drive;
+	if(!drive_number)
+		return;
+	if(trace_prefetching && trace_loaded < trace_saved_count) {
+		FIL* fil = &mounts[drive_number].fil;
+		FRESULT f_op_stat;
+		uint bytes_read;
+		uint16_t sector_number = trace_saved_sectors[trace_loaded];
+		FSIZE_t size = disk_headers[drive_number-1].atr_header.sec_size;
+		if(sector_number <= 3 && size != 512)
+			size = 128;
+		FSIZE_t offset = sizeof(atr_header_type) + atr_sector_offset(drive_number, sector_number);
+		if(!sector_number || offset + size > sizeof(atr_header_type) + mounts[drive_number].status ||
+				trace_buffer_used + size > BOOT_TRACE_BUFFER_SIZE ||
+				disk_cache_write_back_prepare(drive_number, offset, size) != FR_OK) {
+			trace_prefetching = false;
+			return;
+		}
+		mutex_enter_blocking(&fs_lock);
+		if((f_op_stat = f_lseek(fil, offset)) == FR_OK &&
+				(f_op_stat = f_read(fil, &trace_buffer[trace_buffer_used], size, &bytes_read)) == FR_OK &&
+				bytes_read != size)
+			f_op_stat = FR_INT_ERR;
+		mutex_exit(&fs_lock);
+		if(f_op_stat != FR_OK) {
+			trace_prefetching = false;
+			return;
+		}
+		trace_buffer_pos[trace_loaded++] = trace_buffer_used;
+		trace_buffer_used += size;
+		return;
+	}
+	if(trace_recording && trace_count && (trace_count == BOOT_TRACE_SECTORS ||
+			to_ms_since_boot(get_absolute_time()) - last_drive_access > BOOT_TRACE_IDLE_MS)) {
+		trace_recording = false;
+		if(trace_count != trace_saved_count || memcmp(trace_sectors, trace_saved_sectors, trace_count*sizeof(uint16_t)))
+			trace_save();
+	}
+}
+
+#else
+
+static void trace_invalidate(int drive_number) {}
+static void trace_discard(int drive_number) {}
+static void trace_record(int drive_number, uint16_t sector_number) {}
+static bool trace_read(int drive_number, uint16_t sector_number, FSIZE_t to_read) { return false; }
+void disk_cache_trace_mount(int drive_number) {}
+bool disk_cache_trace_busy() { return false; }
+void disk_cache_trace_step() {}
+
+#endif
+
+#if DISK_CACHE_SLOTS > 0
+
+typedef struct {
+	int drive_number; // 0 when the slot is free
+	FSIZE_t offset; // file offset of the first cached byte
+	FSIZE_t size;
+	uint32_t last_use;
+	uint8_t data[DISK_CACHE_SLOT_SIZE];
+} disk_cache_slot_type;
+
+static disk_cache_slot_type disk_cache[DISK_CACHE_SLOTS];
+static uint32_t disk_cache_clock = 0;
+static uint16_t last_sector[DRIVE_COUNT+1] = {0};
+static int prefetch_drive = 0;
+
+static disk_cache_slot_type *find_slot(int drive_number, FSIZE_t offset, FSIZE_t to_read) {
+	for(int i=0; i<DISK_CACHE_SLOTS; i++)
+		if(disk_cache[i].drive_number == drive_number && offset >= disk_cache[i].offset &&
+				offset + to_read <= disk_cache[i].offset + disk_cache[i].size)
+			return &disk_cache[i];
+	return NULL;
+}
+
+static disk_cache_slot_type *reclaim_slot(int drive_number) {
+	disk_cache_slot_type *s = &disk_cache[0];
+	for(int i=0; i<DISK_CACHE_SLOTS; i++) {
+		// Prefer the slot that this drive already occupies
+		if(disk_cache[i].drive_number == drive_number)
+			return &disk_cache[i];
+		if(!disk_cache[i].drive_number || (s->drive_number && disk_cache[i].last_use < s->last_use))
+			s = &disk_cache[i];
+	}
+	return s;
+}
+
+static FRESULT fill_slot(disk_cache_slot_type *s, int drive_number, uint16_t sector_number, FSIZE_t offset) {
+	FIL* fil = &mounts[drive_number].fil;
+	FRESULT f_op_stat;
+	uint bytes_read;
+	uint spt = (mounts[drive_number].status == 0x20800) ? 26 : 18;
+	uint next_track = sector_number + spt - (sector_number-1) % spt;
+	FSIZE_t end = sizeof(atr_header_type) + atr_sector_offset(drive_number, next_track);
+
+	if(end > sizeof(atr_header_type) + mounts[drive_number].status)
+		end = sizeof(atr_header_type) + mounts[drive_number].status;
+	if(end > offset + DISK_CACHE_SLOT_SIZE)
+		end = offset + DISK_CACHE_SLOT_SIZE;
+
+	s->drive_number = 0;
+	if((f_op_stat = disk_cache_write_back_prepare(drive_number, offset, end - offset)) != FR_OK)
+		return f_op_stat;
+	mutex_enter_blocking(&fs_lock);
+	if((f_op_stat = f_lseek(fil, offset)) == FR_OK &&
+			(f_op_stat = f_read(fil, s->data, end - offset, &bytes_read)) == FR_OK &&
+			bytes_read != end - offset)
+		f_op_stat = FR_INT_ERR;
+	mutex_exit(&fs_lock);
+	if(f_op_stat == FR_OK) {
+		s->drive_number = drive_number;
+		s->offset = offset;
+		s->size = end - offset;
+	}
+	return f_op_stat;
+}
+
+FRESULT disk_cache_read(int drive_number, uint16_t sector_number, FSIZE_t offset, FSIZE_t to_read) {
+	FRESULT f_op_stat = FR_OK;
+	// Nothing to read ahead for
+	if(ram_disks[drive_number].data)
+		return mounted_file_transfer(drive_number, offset, to_read, false);
+	trace_record(drive_number, sector_number);
+	if(trace_read(drive_number, sector_number, to_read)) {
+		last_sector[drive_number] = sector_number;
+		disk_cache_hits++;
+		return FR_OK;
+	}
+	bool sequential = (sector_number == last_sector[drive_number] + 1);
+	disk_cache_slot_type *s = find_slot(drive_number, offset, to_read);
+
+	last_sector[drive_number] = sector_number;
+	if(s)
+		disk_cache_hits++;
+	else {
+		disk_cache_misses++;
+		if(!sequential)
+			return mounted_file_transfer(drive_number, offset, to_read, false);
+		s = reclaim_slot(drive_number);
+		if((f_op_stat = fill_slot(s, drive_number, sector_number, offset)) != FR_OK)
+			return f_op_stat;
+	}
+	s->last_use = ++disk_cache_clock;
+	memcpy(sector_buffer, &s->data[offset - s->offset], to_read);
+	prefetch_drive = drive_number;
+	return f_op_stat;
+}
+
+// Called while the data frame of the last read is being sent, if that read
+// emptied the read-ahead window the next track is fetched right away
+void disk_cache_prefetch() {
+	int drive_number = prefetch_drive;
+	if(!drive_number)
+		return;
+	prefetch_drive = 0;
+	uint16_t sector_number = last_sector[drive_number] + 1;
+	FSIZE_t offset = sizeof(atr_header_type) + atr_sector_offset(drive_number, sector_number);
+	if(!sector_number || offset >= sizeof(atr_header_type) + mounts[drive_number].status || find_slot(drive_number, offset, 1))
+		return;
+	fill_slot(reclaim_slot(drive_number), drive_number, sector_number, offset);
+}
+
+void disk_cache_invalidate(int drive_number) {
+	trace_invalidate(drive_number);
+	if(prefetch_drive == drive_number)
+		prefetch_drive = 0;
+	for(int i=0; i<DISK_CACHE_SLOTS; i++)
+		if(disk_cache[i].drive_number == drive_number)
+			disk_cache[i].drive_number = 0;
+	last_sector[drive_number] = 0;
+}
+
+#else
+
+FRESULT disk_cache_read(int drive_number, uint16_t sector_number, FSIZE_t offset, FSIZE_t to_read) {
+	trace_record(drive_number, sector_number);
+	if(trace_read(drive_number, sector_number, to_read)) {
+		disk_cache_hits++;
+		return FR_OK;
+	}
+	disk_cache_misses++;
+	return mounted_file_transfer(drive_number, offset, to_read, false);
+}
+
+void disk_cache_prefetch() {}
+
+void disk_cache_invalidate(int drive_number) {
+	trace_invalidate(drive_number);
+}
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * This file is part of the a8-pico-sio project --
+ * An Atari 8-bit SIO drive and (turbo) tape emulator for
+ * Raspberry Pi Pico, see
+ *
+ *         https://github.com/woj76/a8-pico-sio
+ *
+ * For information on what / whose work it is based on, check the corresponding
+ * source files and the README file. This file is licensed under GNU General
+ * Public License 3.0 or later.
+ *
+ * Copyright (C) 2025 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include "ff.h"
+
+extern volatile uint32_t disk_cache_hits;
+extern volatile uint32_t disk_cache_misses;
+
+FRESULT disk_cache_read(int drive_number, uint16_t sector_number, FSIZE_t offset, FSIZE_t to_read);
+void disk_cache_prefetch();
+void disk_cache_invalidate(int drive_number);
+
+bool disk_cache_ram_load(int drive_number);
+bool disk_cache_ram_transfer(int drive_number, FSIZE_t offset, FSIZE_t size, bool op_write, uint8_t *data, FSIZE_t brpt);
+
+void disk_cache_trace_mount(int drive_number);
+bool disk_cache_trace_busy();
+void disk_cache_trace_step();
+
+bool disk_cache_write(int drive_number, FSIZE_t offset, FSIZE_t size, uint8_t *data);
+bool disk_cache_read_back(int drive_number, FSIZE_t offset, FSIZE_t size, uint8_t *data);
+FRESULT disk_cache_write_back_prepare(int drive_number, FSIZE_t offset, FSIZE_t size);
+FRESULT disk_cache_flush(int drive_number);
+void disk_cache_discard(int drive_number);
+FRESULT disk_cache_release(int drive_number);
+FRESULT disk_cache_read_media(int drive_number, FSIZE_t offset, FSIZE_t size, uint8_t *data);
+void disk_cache_idle();
+bool disk_cache_dirty();
+bool disk_cache_sync_lock();
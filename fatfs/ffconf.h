@@ -41,7 +41,7 @@
 /* This option switches f_expand function. (0:Disable or 1:Enable) */
 
 
-#define FF_USE_CHMOD	0
+#define FF_USE_CHMOD	1
 /* This option switches attribute manipulation functions, f_chmod() and f_utime().
 /  (0:Disable or 1:Enable) Also FF_FS_READONLY needs to be 0 to enable this option. */
 
@@ -223,7 +223,12 @@
 / System Configurations
 /---------------------------------------------------------------------------*/
 
+#include "pico.h"
+#ifdef RASPBERRYPI_PICO2
 #define FF_FS_TINY		0
+#else
+#define FF_FS_TINY		1
+#endif
 /* This option switches tiny buffer configuration. (0:Normal or 1:Tiny)
 /  At the tiny configuration, size of file object (FIL) is shrinked FF_MAX_SS bytes.
 /  Instead of private sector buffer eliminated from the file object, common sector
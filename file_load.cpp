@@ -51,7 +51,7 @@ static bool is_valid_file(char *filename) {
 		case file_type::casette:
 			return !strcasecmp(&filename[i], "CAS") || !strcasecmp(&filename[i], "WAV");
 		case file_type::disk:
-			return !strcasecmp(&filename[i], "ATR") || !strcasecmp(&filename[i], "ATX") || !strcasecmp(&filename[i], "XEX") || !strcasecmp(&filename[i], "COM") || !strcasecmp(&filename[i], "EXE");
+			return !strcasecmp(&filename[i], "ATR") || !strcasecmp(&filename[i], "ATX") || !strcasecmp(&filename[i], "XEX") || !strcasecmp(&filename[i], "COM") || !strcasecmp(&filename[i], "EXE") || !strcasecmp(&filename[i], "CAS");
 		default:
 			return false;
 	}
@@ -19,10 +19,11 @@
 #include "hardware/dma.h"
 #include "hardware/irq.h"
 #include "hardware/uart.h"
-#include "pico/util/queue.h"
+#include "hardware/structs/systick.h"
 
 #include "io.hpp"
 #include "wav_decode.hpp"
+#include "mounts.hpp"
 
 #include "options.hpp"
 #include "led_indicator.hpp"
@@ -94,14 +95,48 @@ uint pio_offset;
 
 int8_t turbo_conf[] = {-1, -1, -1};
 
-queue_t pio_queue;
+// The pulses for the PIO go through a ring buffer that the DMA reads with the
+// address wrapping, the DMA gets restarted (from the interrupt) with at most half
+// of the ring at a time, so that the other half can be refilled in the meantime.
 // 10*8 is not enough for Turbo D 9000, but going wild here costs memory, each item is 4 bytes
 // 16*8 also fails sometimes with the 1MHz base clock
 // The WAV decoding now seems to work with 64, but increasing it might be a good idea if some WAV file is not working
 // WAV files with 96000 sample rate also prefer this to be more than 64
-const int pio_queue_size = 96*8;
+#define pio_ring_bits 10
+#define pio_ring_size (1u << pio_ring_bits)
+
+static volatile uint32_t __attribute__((aligned(pio_ring_size*sizeof(uint32_t)))) pio_ring[pio_ring_size];
+static volatile uint32_t pio_ring_head = 0; // next item to be written
+static volatile uint32_t pio_ring_tail = 0; // next item to be handed to the DMA
+static volatile uint32_t pio_ring_done = 0; // items already read by the DMA
+
+// Cycles that the last level of the previous word took on top of the requested
+// duration (the dispatch after a stop bit or the last pairs half pulse), the
+// next single pulse is shortened
+// by these so that the levels after it stay in time
+static uint32_t pio_carry_cycles = 0;
+
+// For checking how many pulses there are per DMA interrupt
+volatile uint32_t pio_dma_irqs = 0;
+volatile uint32_t pio_dma_items = 0;
+
+// System clock cycles spent in the DMA interrupt handler and in putting the items
+// into the ring (not counting the wait for space), for the per item overhead on
+// the stats screen. The SysTick counters of both cores count down from 2^24,
+// each side only measures short stretches of code.
+volatile uint64_t pio_dma_irq_cycles = 0;
+volatile uint64_t pio_dma_put_cycles = 0;
+
+void pio_cycles_init() {
+	systick_hw->rvr = 0xFFFFFF;
+	systick_hw->cvr = 0;
+	// Enabled, counting the processor clock
+	systick_hw->csr = 0x5;
+}
 
-uint32_t pio_e;
+static inline uint32_t pio_cycles_since(uint32_t t) {
+	return (t - systick_hw->cvr) & 0xFFFFFF;
+}
 
 void reinit_pio() {
 	if(turbo_conf[0] != current_options[turbo1_option_index]) {
@@ -114,36 +149,96 @@ void reinit_pio() {
 		turbo_data_pin = opt_to_turbo_data_pin[turbo_conf[0]];
 		pio_gpio_init(cas_pio, turbo_data_pin);
 		sm_config_set_out_pins(&sm_config_turbo, turbo_data_pin, 1);
+		sm_config_set_in_pins(&sm_config_turbo, turbo_data_pin);
 		pio_sm_set_consecutive_pindirs(cas_pio, sm_turbo, turbo_data_pin, 1, true);
-		pio_sm_init(cas_pio, sm_turbo, pio_offset, &sm_config_turbo);
+		pio_sm_init(cas_pio, sm_turbo, pio_offset + pin_io_offset_dispatch, &sm_config_turbo);
 		pio_sm_set_enabled(cas_pio, sm_turbo, true);
 	}
 	turbo_conf[1] = current_options[turbo2_option_index];
 	turbo_motor_pin_mask = opt_to_turbo_motor_pin_mask[turbo_conf[1]];
 	turbo_motor_value_on = opt_to_turbo_motor_pin_val[turbo_conf[1]];
+	// The SIO data out line only takes the edge interrupts when it is used
+	// as the motor line, the normal motor and the command lines always do
+	gpio_set_irq_enabled(joy2_p2_pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, turbo_motor_pin_mask & kso_motor_pin_mask);
+	gpio_set_irq_enabled(sio_rx_pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, turbo_motor_pin_mask & (1u << sio_rx_pin));
 	turbo_conf[2] = current_options[turbo3_option_index];
 	//while(!queue_is_empty(&pio_queue))
 	//		tight_loop_contents();
 	pio_sm_restart(cas_pio, sm);
 	pio_sm_restart(cas_pio, sm_turbo);
+	// The restart does not move the program counter, the state machines could
+	// be in the middle of a routine, get them back to reading a new word
+	pio_sm_exec(cas_pio, sm, pio_encode_jmp(pio_offset + pin_io_offset_dispatch));
+	pio_sm_exec(cas_pio, sm_turbo, pio_encode_jmp(pio_offset + pin_io_offset_dispatch));
 }
 
 volatile bool dma_going = false;
 int dma_channel, dma_channel_turbo;
+int uart_dma_channel;
 
 
-static void dma_handler() {
-	int dc = dma_block_turbo ? dma_channel_turbo : dma_channel;
-	if(dma_going)
-		dma_hw->ints1 = 1u << dc;
-	else
+static void pio_ring_start(int dc) {
+	uint32_t n = pio_ring_head - pio_ring_tail;
+	if(n > pio_ring_size/2)
+		n = pio_ring_size/2;
+	if(n) {
 		dma_going = true;
-	if(queue_try_remove(&pio_queue, &pio_e))
-		dma_channel_start(dc);
-	else
+		dma_channel_transfer_from_buffer_now(dc, &pio_ring[pio_ring_tail & (pio_ring_size-1)], n);
+		pio_ring_tail += n;
+	} else
 		dma_going = false;
 }
 
+static volatile bool motor_watch = false;
+static volatile bool motor_running = true;
+
+// Underruns, the ring went empty with the tape playing and the state machine
+// ended up waiting for data, rather than at the end of a block that the SIO
+// loop lets drain on purpose
+pio_underrun_type pio_underruns;
+static volatile uint32_t pio_ring_empty_time;
+static volatile bool pio_underrun_skip_next = true;
+
+void pio_underrun_reset() {
+	pio_underruns.count = 0;
+	pio_underruns.max_gap_us = 0;
+	pio_underruns.min_depth = pio_ring_size;
+	pio_underruns.offset = 0;
+	pio_underrun_skip_next = true;
+}
+
+void pio_underrun_skip() {
+	pio_underrun_skip_next = true;
+}
+
+static void pio_underrun_check(uint s) {
+	uint32_t stall = 1u << (PIO_FDEBUG_TXSTALL_LSB + s);
+	if((cas_pio->fdebug & stall) && !pio_underrun_skip_next && motor_watch && motor_running && mounts[0].status < cas_size) {
+		uint32_t gap = time_us_32() - pio_ring_empty_time;
+		pio_underruns.count++;
+		if(gap > pio_underruns.max_gap_us)
+			pio_underruns.max_gap_us = gap;
+		pio_underruns.offset = mounts[0].status;
+	}
+	// Clear the stall flag for the next time
+	cas_pio->fdebug = stall;
+	pio_underrun_skip_next = false;
+}
+
+static void dma_handler() {
+	uint32_t t = systick_hw->cvr;
+	int dc = dma_block_turbo ? dma_channel_turbo : dma_channel;
+	dma_hw->ints1 = 1u << dc;
+	pio_dma_irqs++;
+	pio_ring_done = pio_ring_tail;
+	if(motor_watch && motor_running && !pio_underrun_skip_next && pio_ring_head - pio_ring_tail < pio_underruns.min_depth)
+		pio_underruns.min_depth = pio_ring_head - pio_ring_tail;
+	pio_ring_start(dc);
+	if(!dma_going)
+		pio_ring_empty_time = time_us_32();
+	pio_dma_irq_cycles += pio_cycles_since(t);
+}
+
 bool cas_motor_on() {
 	return (cas_block_turbo ? turbo_motor_value_on : normal_motor_value_on) ==
 		(gpio_get_all() & (cas_block_turbo ? turbo_motor_pin_mask : normal_motor_pin_mask));
@@ -151,7 +246,10 @@ bool cas_motor_on() {
 
 void flush_pio() {
 	wav_sample_size = 0;
-	pio_sm_set_enabled(cas_pio, cas_block_turbo ? sm_turbo : sm, true);
+	motor_watch = false;
+	motor_running = true;
+	pio_carry_cycles = 0;
+	pio_set_sm_mask_enabled(cas_pio, (1u << sm) | (1u << sm_turbo), true);
 	blue_blinks = 0;
 	green_blinks = 0;
 	update_rgb_led(false);
@@ -160,66 +258,207 @@ void flush_pio() {
 	//pio_interrupt_clear(cas_pio, 7);
 }
 
-static bool repeating_timer_motor(struct repeating_timer *t) {
-#if MOTOR_OFF_DELAY > 0
-	static uint motor_off_delay = MOTOR_OFF_DELAY;
-#endif
-#if MOTOR_ON_DELAY > 0
-	static uint motor_on_delay = MOTOR_ON_DELAY;
-#endif
+// The motor lines are followed with the GPIO edge interrupts, once the tape
+// playback has started both state machines are stopped and started right at
+// the motor edges (or after the optional delays), also in the middle of a block.
+// Multi-stage loaders that toggle the motor between the blocks do not lose any
+// of the signal this way.
+
+static void motor_apply(bool on) {
+	motor_running = on;
+	// The state machines waited for the motor, not for the data
+	pio_underrun_skip_next = true;
+	pio_set_sm_mask_enabled(cas_pio, (1u << sm) | (1u << sm_turbo), on);
 	if(wav_sample_size) {
-		if(!cas_motor_on()) {
-#if MOTOR_ON_DELAY > 0
-			motor_on_delay = MOTOR_ON_DELAY;
-#endif
-#if MOTOR_OFF_DELAY > 0
-			if(motor_off_delay)
-				motor_off_delay--;
-			else
-#endif
-			{
-				//pio_sm_exec(cas_pio, cas_block_turbo ? sm_turbo : sm, pio_encode_irq_set(false, 7));
-				////sleep_ms(1);
-				//pio_sm_exec(cas_pio, cas_block_turbo ? sm_turbo : sm, pio_encode_wait_irq(0, false, 7));
-				pio_sm_set_enabled(cas_pio, cas_block_turbo ? sm_turbo : sm, false);
-				blue_blinks = 0;
-				green_blinks = 0;
-				update_rgb_led(false);
-			}
-		} else {
-#if MOTOR_OFF_DELAY > 0
-			motor_off_delay = MOTOR_OFF_DELAY;
-#endif
-#if MOTOR_ON_DELAY > 0
-			if(motor_on_delay)
-				motor_on_delay--;
-			else
+		if(on && cas_block_turbo)
+			blue_blinks = -1;
+		else
+			blue_blinks = 0;
+		green_blinks = on ? -1 : 0;
+		update_rgb_led(false);
+	}
+}
+
+#if MOTOR_OFF_DELAY > 0 || MOTOR_ON_DELAY > 0
+static volatile alarm_id_t motor_alarm = 0;
+
+static int64_t motor_alarm_callback(alarm_id_t id, void *user_data) {
+	motor_alarm = 0;
+	if(motor_watch)
+		motor_apply(user_data != NULL);
+	return 0;
+}
 #endif
-			{
-				//pio_interrupt_clear(cas_pio, 7);
-				pio_sm_set_enabled(cas_pio, cas_block_turbo ? sm_turbo : sm, true);
-				if(cas_block_turbo)
-					blue_blinks = -1;
-				green_blinks = -1;
-				update_rgb_led(false);
-			}
 
+static void motor_irq_handler() {
+	// The command line interrupt belongs to the SIO command capture
+	gpio_acknowledge_irq(normal_motor_pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE);
+	gpio_acknowledge_irq(joy2_p2_pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE);
+	gpio_acknowledge_irq(sio_rx_pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE);
+	if(!motor_watch)
+		return;
+	bool on = cas_motor_on();
+#if MOTOR_OFF_DELAY > 0 || MOTOR_ON_DELAY > 0
+	if(motor_alarm) {
+		cancel_alarm(motor_alarm);
+		motor_alarm = 0;
+	}
+	if(on == motor_running)
+		return;
+	uint32_t delay = on ? MOTOR_ON_DELAY : MOTOR_OFF_DELAY;
+	if(delay) {
+		alarm_id_t a = add_alarm_in_ms(delay, motor_alarm_callback, on ? (void *)1 : NULL, true);
+		if(a > 0) {
+			motor_alarm = a;
+			return;
 		}
 	}
+#endif
+	if(on != motor_running)
+		motor_apply(on);
+}
+
+void pio_motor_watch() {
+	// The playback only goes on with the motor running, the block type
+	// (and so the motor line) could have changed with the state machines
+	// stopped though
+	motor_watch = true;
+	if(!motor_running && cas_motor_on())
+		motor_apply(true);
+}
+
+uint32_t pio_ring_free() {
+	return pio_ring_size - (pio_ring_head - pio_ring_done);
+}
+
+// The items of the other state machine can only go out once the ring has been
+// drained, with the motor off mid-block that does not happen until it is back on
+bool pio_ring_switching() {
+	return dma_going && dma_block_turbo != cas_block_turbo;
+}
+
+static bool pio_ring_put(uint32_t e) {
+	if(pio_ring_switching())
+		return false;
+	while(pio_ring_head - pio_ring_done >= pio_ring_size)
+		tight_loop_contents();
+	uint32_t t = systick_hw->cvr;
+	pio_ring[pio_ring_head & (pio_ring_size-1)] = e;
+	pio_ring_head++;
+	pio_dma_items++;
+	// Only core 1 adds items, when the DMA is not going there is no
+	// interrupt (taken by core 0) to race with
+	if(!dma_going) {
+		dma_block_turbo = cas_block_turbo;
+		pio_underrun_check(dma_block_turbo ? sm_turbo : sm);
+		pio_ring_start(dma_block_turbo ? dma_channel_turbo : dma_channel);
+	}
+	pio_dma_put_cycles += pio_cycles_since(t);
 	return true;
 }
 
-void pio_enqueue(uint8_t b, uint32_t d) {
-	uint32_t e = (b^(cas_block_turbo ? turbo_conf[2] : 0) | ((d - pio_prog_cycle_corr) << 1));
+// All of the enqueue functions return false (with nothing added) while the ring
+// is switching to the other state machine, only the first word can hit that
+bool pio_enqueue(uint8_t b, uint32_t d) {
+	if(pio_ring_switching())
+		return false;
+	b ^= (cas_block_turbo ? turbo_conf[2] : 0);
+	uint32_t c = pio_prog_cycle_corr + pio_carry_cycles;
+	pio_carry_cycles = 0;
+	d = (d > c) ? d - c : 0;
 //	queue_try_add(&pio_queue, &e);
 //	absolute_time_t t = make_timeout_time_ms(1250);
 //	while (!gpio_get(command_line_pin) && absolute_time_diff_us(get_absolute_time(), t) > 0)
 //		tight_loop_contents();
-	queue_add_blocking(&pio_queue, &e);
-	if(!dma_going) {
-		dma_block_turbo = cas_block_turbo;
-		dma_handler();
+	// Pulses longer than what fits into one word are split into several of the same level
+	while(d > pio_pulse_max_delay) {
+		if(!pio_ring_put((pio_offset + pin_io_offset_pulse) | (b << 5) | ((pio_pulse_max_delay/2) << 6)))
+			return false;
+		d -= pio_pulse_max_delay/2 + pio_prog_cycle_corr;
 	}
+	return pio_ring_put((pio_offset + pin_io_offset_pulse) | (b << 5) | (d << 6));
+}
+
+// One word for the whole standard SIO byte, the PIO adds the start and stop bits,
+// with the full speed PIO clock the 600 baud bit duration does not fit, then it is
+// sent bit by bit as before
+bool pio_enqueue_byte(uint8_t b, uint32_t d) {
+	if(d <= pio_byte_cycle_corr || d - pio_byte_cycle_corr > pio_byte_max_delay) {
+		if(!pio_enqueue(0, d))
+			return false;
+		for(int j=0; j!=8; j++) {
+			pio_enqueue(b & 0x1, d);
+			b >>= 1;
+		}
+		pio_enqueue(1, d);
+		return true;
+	}
+	uint32_t f = (b << 1) | 0x200;
+	if(cas_block_turbo && turbo_conf[2])
+		f ^= 0x3FF;
+	if(!pio_ring_put((pio_offset + pin_io_offset_byte) | ((d - pio_byte_cycle_corr) << 5) | (f << 22)))
+		return false;
+	pio_carry_cycles = pio_byte_stop_cycles;
+	return true;
+}
+
+// A train of n pulse pairs, each half pulse of the same duration, the first half
+// at the level b, as two words. For the pwmc pilot tones.
+bool pio_enqueue_pairs(uint8_t b, uint32_t d, uint16_t n) {
+	if(!n)
+		return true;
+	if(d <= pio_pairs_cycle_corr || d - pio_pairs_cycle_corr > pio_pulse_max_delay) {
+		if(!pio_enqueue(b, d))
+			return false;
+		pio_enqueue(b^1, d);
+		for(uint16_t j=1; j<n; j++) {
+			pio_enqueue(b, d);
+			pio_enqueue(b^1, d);
+		}
+		return true;
+	}
+	b ^= (cas_block_turbo ? turbo_conf[2] : 0);
+	if(!pio_ring_put((pio_offset + pin_io_offset_pairs) | (b << 5) | ((d - pio_pairs_cycle_corr) << 6)))
+		return false;
+	pio_ring_put(2*n - 1);
+	pio_carry_cycles = pio_pairs_last_cycle_corr - pio_pairs_cycle_corr;
+	return true;
+}
+
+// A PWM encoded byte, each bit as a pulse pair with the half pulse duration of
+// d0 or d1, the first half at the level b, as two words. For the pwmd data.
+bool pio_enqueue_pwm_byte(uint8_t b, uint8_t v, uint32_t d0, uint32_t d1, bool msb_first) {
+	int bs, be, bd;
+	if (msb_first) {
+		bs=7; be=-1; bd=-1;
+	} else {
+		bs=0; be=8; bd=1;
+	}
+	if(d0 <= pio_pwm_cycle_corr || d0 - pio_pwm_cycle_corr > pio_pwm_max_delay ||
+		d1 <= pio_pwm_cycle_corr || d1 - pio_pwm_cycle_corr > pio_pwm_max_delay) {
+		if(pio_ring_switching())
+			return false;
+		for(int j=bs; j!=be; j += bd) {
+			uint32_t d = ((v >> j) & 0x1) ? d1 : d0;
+			pio_enqueue(b, d);
+			pio_enqueue(b^1, d);
+		}
+		return true;
+	}
+	uint32_t h = 0;
+	int k = 0;
+	for(int j=bs; j!=be; j += bd) {
+		// Bit value and the "more to come" bit for both halves
+		uint32_t x = (v >> j) & 0x1;
+		h |= ((x | 0x2) << k) | ((x | (k != 28 ? 0x2 : 0)) << (k+2));
+		k += 4;
+	}
+	b ^= (cas_block_turbo ? turbo_conf[2] : 0);
+	if(!pio_ring_put((pio_offset + pin_io_offset_pwm_byte) | (b << 5) | ((d0 - pio_pwm_cycle_corr) << 6) | ((d1 - pio_pwm_cycle_corr) << 19)))
+		return false;
+	pio_ring_put(h);
+	pio_carry_cycles = pio_pwm_last_cycle_corr - pio_pwm_cycle_corr;
+	return true;
 }
 
 void init_io() {
@@ -246,8 +485,6 @@ void init_io() {
 #endif
 	gpio_init(command_line_pin); gpio_set_dir(command_line_pin, GPIO_IN); gpio_pull_up(command_line_pin);
 
-	queue_init(&pio_queue, sizeof(uint32_t), pio_queue_size);
-
 	pio_offset = pio_add_program(cas_pio, &pin_io_program);
  	int clk_divider = clock_get_hz(clk_sys)/timing_base_clock;
 
@@ -259,8 +496,9 @@ void init_io() {
 	sm_config_set_clkdiv_int_frac(&c, clk_divider, 0);
 
 	sm_config_set_out_pins(&c, sio_tx_pin, 1);
+	sm_config_set_in_pins(&c, sio_tx_pin);
 	sm_config_set_out_shift(&c, true, true, 32);
-	pio_sm_init(cas_pio, sm, pio_offset, &c);
+	pio_sm_init(cas_pio, sm, pio_offset + pin_io_offset_dispatch, &c);
 	pio_sm_set_enabled(cas_pio, sm, true);
 
 	sm_turbo = pio_claim_unused_sm(cas_pio, true);
@@ -277,19 +515,22 @@ void init_io() {
 	dma_channel = dma_claim_unused_channel(true);
 	dma_channel_config dma_c = dma_channel_get_default_config(dma_channel);
 	channel_config_set_transfer_data_size(&dma_c, DMA_SIZE_32);
-	channel_config_set_read_increment(&dma_c, false);
+	channel_config_set_read_increment(&dma_c, true);
+	channel_config_set_ring(&dma_c, false, pio_ring_bits+2);
 	channel_config_set_dreq(&dma_c, pio_get_dreq(cas_pio, sm, true));
-	dma_channel_configure(dma_channel, &dma_c, &cas_pio->txf[sm], &pio_e, 1, false);
+	dma_channel_configure(dma_channel, &dma_c, &cas_pio->txf[sm], pio_ring, 1, false);
 	dma_channel_set_irq1_enabled(dma_channel, true);
 
 	dma_channel_turbo = dma_claim_unused_channel(true);
 	dma_channel_config dma_c1 = dma_channel_get_default_config(dma_channel_turbo);
 	channel_config_set_transfer_data_size(&dma_c1, DMA_SIZE_32);
-	channel_config_set_read_increment(&dma_c1, false);
+	channel_config_set_read_increment(&dma_c1, true);
+	channel_config_set_ring(&dma_c1, false, pio_ring_bits+2);
 	channel_config_set_dreq(&dma_c1, pio_get_dreq(cas_pio, sm_turbo, true));
-	dma_channel_configure(dma_channel_turbo, &dma_c1, &cas_pio->txf[sm_turbo], &pio_e, 1, false);
+	dma_channel_configure(dma_channel_turbo, &dma_c1, &cas_pio->txf[sm_turbo], pio_ring, 1, false);
 	dma_channel_set_irq1_enabled(dma_channel_turbo, true);
 
+	pio_cycles_init();
 	irq_set_exclusive_handler(DMA_IRQ_1, dma_handler);
 
 	irq_set_enabled(DMA_IRQ_1, true);
@@ -301,6 +542,17 @@ void init_io() {
 	uart_set_fifo_enabled(uart1, false);
 	uart_set_format(uart1, 8, 1, UART_PARITY_NONE);
 
-	static struct repeating_timer tmr;
-	add_repeating_timer_ms(MOTOR_CHECK_INTERVAL_MS, repeating_timer_motor, NULL, &tmr);
+	// SIO data frames are sent out by DMA, the UART DMA request
+	// signals are always enabled by uart_init
+	uart_dma_channel = dma_claim_unused_channel(true);
+	dma_channel_config dma_u = dma_channel_get_default_config(uart_dma_channel);
+	channel_config_set_transfer_data_size(&dma_u, DMA_SIZE_8);
+	channel_config_set_read_increment(&dma_u, true);
+	channel_config_set_write_increment(&dma_u, false);
+	channel_config_set_dreq(&dma_u, uart_get_dreq(uart1, true));
+	dma_channel_configure(uart_dma_channel, &dma_u, &uart_get_hw(uart1)->dr, NULL, 0, false);
+
+	gpio_add_raw_irq_handler_masked(normal_motor_pin_mask | kso_motor_pin_mask | (1u << sio_rx_pin), motor_irq_handler);
+	gpio_set_irq_enabled(normal_motor_pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true);
+	irq_set_enabled(IO_IRQ_BANK0, true);
 }
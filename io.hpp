@@ -17,8 +17,6 @@
 #include <stdint.h>
 #include <hardware/gpio.h>
 
-#define MOTOR_CHECK_INTERVAL_MS 10
-
 #define cas_pio pio0
 #define GPIO_FUNC_PIOX GPIO_FUNC_PIO0
 
@@ -63,9 +61,32 @@ extern volatile bool cas_block_turbo;
 extern volatile bool dma_block_turbo;
 extern uint sm;
 extern uint sm_turbo;
+extern int uart_dma_channel;
+extern volatile uint32_t pio_dma_irqs;
+extern volatile uint32_t pio_dma_items;
+extern volatile uint64_t pio_dma_irq_cycles;
+extern volatile uint64_t pio_dma_put_cycles;
+
+typedef struct {
+	uint32_t count;
+	uint32_t max_gap_us; // at most, includes the time to drain the PIO FIFO
+	uint32_t min_depth; // lowest number of ring items left at a DMA interrupt
+	uint32_t offset; // image read position at the last underrun
+} pio_underrun_type;
+
+extern pio_underrun_type pio_underruns;
 
 void init_io();
+void pio_cycles_init();
 void reinit_pio();
-void pio_enqueue(uint8_t b, uint32_t d);
+uint32_t pio_ring_free();
+bool pio_ring_switching();
+bool pio_enqueue(uint8_t b, uint32_t d);
+bool pio_enqueue_byte(uint8_t b, uint32_t d);
+bool pio_enqueue_pairs(uint8_t b, uint32_t d, uint16_t n);
+bool pio_enqueue_pwm_byte(uint8_t b, uint8_t v, uint32_t d0, uint32_t d1, bool msb_first);
 bool cas_motor_on();
+void pio_motor_watch();
+void pio_underrun_reset();
+void pio_underrun_skip();
 void flush_pio();
@@ -54,6 +54,8 @@ https://forums.atariage.com/topic/282759-databyte-disks-on-atari-810/?do=findCom
 #include "options.hpp"
 #include "wav_decode.hpp"
 #include "sio.hpp"
+#include "disk_cache.hpp"
+#include "pin_capture.hpp"
 
 #include "font_atari_data.hpp"
 
@@ -75,6 +77,19 @@ constexpr std::string_view str_no_media{"No media!?"};
 constexpr std::string_view str_config2{"Config"};
 constexpr std::string_view str_creating{" Creating... "};
 constexpr std::string_view str_create_failed{"Create failed!"};
+constexpr std::string_view str_tape_blocks{"Tape blocks"};
+constexpr std::string_view str_other_file{"Other file..."};
+constexpr std::string_view str_accel_off{"Accelerated OFF"};
+constexpr std::string_view str_accel_on{"Accelerated  ON"};
+constexpr std::string_view str_stats{"Statistics"};
+
+#ifdef TAPE_CALIBRATION
+constexpr std::string_view str_tape_timing{"Tape timing"};
+constexpr std::string_view str_measuring{"Measuring..."};
+constexpr std::string_view str_stop_tape{"Stop the tape!"};
+constexpr std::string_view str_timing_header{"ns      avg  max <1u"};
+const char * const pin_capture_type_names[] = {"Pulse", "Byte", "Pairs", "PWM"};
+#endif
 
 constexpr std::string_view str_about1{"A8 Pico SIO"};
 constexpr std::string_view str_about2{"by woj@AtariAge"};
@@ -372,8 +387,8 @@ const char * const mount_option_names_short[] = {"  OFF", "   ON"};
 const char * const mount_option_names_long[] = {"Read-only", "Read/Write"};
 const char * const clock_option_names_short[] = {"  PAL", " NTSC"};
 const char * const clock_option_names_long[] = {"PAL at 1.77MHz", "NTSC at 1.79MHz"};
-const char * const hsio_option_names_short[] = {"  $28", "  $10", "   $6", "   $5","   $4", "   $3","   $2", "   $1", "   $0"};
-const char * const hsio_option_names_long[] = {"$28 OFF/Standard", "$10 ~39 kbit/s", " $6 ~68 kbit/s", " $5 ~74 kbit/s"," $4 ~81 kbit/s", " $3 ~90 kbit/s", " $2 ~99 kbit/s", " $1 ~111 kbit/s", " $0 ~127 kbit/s"};
+const char * const hsio_option_names_short[] = {"  $28", "  $10", "   $6", "   $5","   $4", "   $3","   $2", "   $1", "   $0", " Auto"};
+const char * const hsio_option_names_long[] = {"$28 OFF/Standard", "$10 ~39 kbit/s", " $6 ~68 kbit/s", " $5 ~74 kbit/s"," $4 ~81 kbit/s", " $3 ~90 kbit/s", " $2 ~99 kbit/s", " $1 ~111 kbit/s", " $0 ~127 kbit/s", "Auto/Tuned"};
 const char * const atx_option_names_short[] = {" 1050", "  810"};
 const char * const atx_option_names_long[] = {"Atari 1050", "Atari 810"};
 const char * const xex_option_names_short[] = {" $500", " $600", " $700", " $800", " $900", " $A00"};
@@ -400,7 +415,7 @@ const option_list option_lists[] = {
 		.long_names = clock_option_names_long
 	},
 	{
-		.count = 9,
+		.count = 10,
 		.short_names = hsio_option_names_short,
 		.long_names = hsio_option_names_long
 	},
@@ -449,7 +464,10 @@ const char * const str_rot_up = "Rotate Up";
 const char * const str_rot_down = "Rotate Down";
 const char * const str_about = "About...";
 
-const int menu_to_mount[] = {-1,1,2,3,4,-1,-1,0,-1};
+// The four drive entries show the drives of the current bank
+int menu_to_mount[] = {-1,1,2,3,4,-1,-1,0,-1};
+int drive_bank = 0;
+#define drive_bank_count ((DRIVE_COUNT+3)/4)
 
 const file_type menu_to_type[] = {
 	file_type::none, // Config
@@ -467,12 +485,15 @@ typedef struct {
 	size_t wd;
 } menu_entry;
 
-const menu_entry menu_entries[] = {
+// Shown in the last bank when the drive count is not a multiple of 4
+char str_no_drive[] = "               ";
+
+menu_entry menu_entries[] = {
 	{.str = (char *)str_config,.x=6*8*font_scale,.y=4*font_scale,.wd=strlen(str_config)},
-	{.str = str_d1,.x=3*8*font_scale,.y=(3*8-4)*font_scale,.wd=strlen(str_d1)},
-	{.str = str_d2,.x=3*8*font_scale,.y=(4*8-4)*font_scale,.wd=strlen(str_d2)},
-	{.str = str_d3,.x=3*8*font_scale,.y=(5*8-4)*font_scale,.wd=strlen(str_d3)},
-	{.str = str_d4,.x=3*8*font_scale,.y=(6*8-4)*font_scale,.wd=strlen(str_d4)},
+	{.str = str_no_drive,.x=3*8*font_scale,.y=(3*8-4)*font_scale,.wd=strlen(str_no_drive)},
+	{.str = str_no_drive,.x=3*8*font_scale,.y=(4*8-4)*font_scale,.wd=strlen(str_no_drive)},
+	{.str = str_no_drive,.x=3*8*font_scale,.y=(5*8-4)*font_scale,.wd=strlen(str_no_drive)},
+	{.str = str_no_drive,.x=3*8*font_scale,.y=(6*8-4)*font_scale,.wd=strlen(str_no_drive)},
 	{.str = (char *)str_rot_up,.x=6*8*font_scale,.y=(7*8)*font_scale,.wd=strlen(str_rot_up)},
 	{.str = (char *)str_rot_down,.x=5*8*font_scale,.y=(8*8)*font_scale,.wd=strlen(str_rot_down)},
 	{.str = str_cas,.x=3*8*font_scale,.y=(10*8)*font_scale,.wd=strlen(str_cas)},
@@ -483,6 +504,20 @@ const menu_entry menu_entries[] = {
 
 const uint mount_to_menu[] = {7,1,2,3,4};
 
+void set_drive_bank(int b) {
+	drive_bank = b;
+	for(int i=1; i<=4; i++) {
+		int m = b*4+i;
+		if(m <= DRIVE_COUNT) {
+			menu_to_mount[i] = m;
+			menu_entries[i].str = mounts[m].str;
+		} else {
+			menu_to_mount[i] = -1;
+			menu_entries[i].str = str_no_drive;
+		}
+	}
+}
+
 typedef struct {
 	const std::string_view *str;
 	int x, y;
@@ -520,9 +555,25 @@ void update_menu_entry(int i) {
 	print_text(menu_entries[i].str, i==cursor_position ? menu_entries[i].wd : 0);
 }
 
-#define cas_pg_width 208
+#define cas_pg_width 112
 ProgressBar cas_pg(cas_pg_width,(11*8+2)*font_scale, true);
 
+// The tape counter on the left and the total time on the right of the progress
+// bar, in playback seconds (negative to clear)
+void print_cas_time(int x, int t) {
+	text_location.x = x;
+	text_location.y = (11*8+6)*font_scale;
+	Rect r(text_location.x,text_location.y,5*8*font_scale,8*font_scale);
+	graphics.set_pen(BG); graphics.rectangle(r);
+	if(t < 0)
+		return;
+	if(t > 99*60+59)
+		t = 99*60+59;
+	char buf[8];
+	sprintf(buf, "%2d:%02d", t/60, t%60);
+	print_text(std::string_view(buf));
+}
+
 void update_main_menu_buttons() {
 	int m = menu_to_mount[cursor_position];
 	if(m != -1) {
@@ -532,7 +583,9 @@ void update_main_menu_buttons() {
 			main_buttons[0].str = m ? &char_inject : &char_play;
 		else
 			main_buttons[0].str = &char_empty;
-	}else
+	}else if(drive_bank_count > 1 && (cursor_position == 5 || cursor_position == 6))
+		main_buttons[0].str = (cursor_position == 5) ? &char_up : &char_down;
+	else
 		main_buttons[0].str = &char_empty;
 	update_buttons(main_buttons, cursor_prev == -1 ? main_buttons_size : 1);
 }
@@ -1140,6 +1193,10 @@ restart_options:
 				int old_clock_option = current_options[clock_option_index];
 				select_option(cursor_position);
 				if(current_options[hsio_option_index] != old_hsio_option) {
+					if(current_options[hsio_option_index] == hsio_option_auto) {
+						hsio_auto_index[0] = hsio_auto_index[1] = hsio_auto_index_max;
+						save_hsio_auto_flag = true;
+					}
 					high_speed = -1;
 					uart_set_baudrate(uart1, current_options[clock_option_index] ? hsio_opt_to_baud_ntsc[0] : hsio_opt_to_baud_pal[0]);
 				}
@@ -1156,6 +1213,242 @@ restart_options:
 	cursor_prev = -1;
 }
 
+#define cas_block_rows 10
+static uint16_t cas_block_list[CAS_INDEX_CHUNKS];
+
+void update_cas_block_entry(int i, int count, int top, bool erase) {
+	text_location.x = 2*8*font_scale;
+	text_location.y = (2+(2+i-top)*10)*font_scale;
+	if(erase) {
+		Rect r(text_location.x,text_location.y,16*8*font_scale,8*font_scale);
+		graphics.set_pen(BG); graphics.rectangle(r);
+	}
+	if(i < 2) {
+		print_text(i ? (cas_accelerated ? str_accel_on : str_accel_off) : str_other_file, i==cursor_position ? 16 : 0);
+		return;
+	}
+	// Core 1 frees the index when the image is mounted again
+	mutex_enter_blocking(&mount_lock);
+	if(cas_block_list[i-2] >= cas_chunk_count) {
+		mutex_exit(&mount_lock);
+		return;
+	}
+	cas_chunk_type c = cas_chunks[cas_block_list[i-2]];
+	// Mark the block around the last underrun
+	bool u = pio_underruns.count && c.offset <= pio_underruns.offset &&
+		(i-1 == count-2 || cas_block_list[i-1] >= cas_chunk_count || cas_chunks[cas_block_list[i-1]].offset > pio_underruns.offset);
+	bool timed = cas_times_ready;
+	mutex_exit(&mount_lock);
+	int t = c.time/1000;
+	if(t > 99*60+59)
+		t = 99*60+59;
+	char ts[6] = "--:--";
+	if(timed)
+		sprintf(ts, "%2d:%02d", t/60, t%60);
+	sprintf(temp_array, "%3d %s %.4s%s", i-1, ts, (const char *)&c.header.signature, u ? " !" : "");
+	print_text(std::string_view(temp_array), i==cursor_position ? 16 : 0);
+}
+
+void update_cas_blocks(int count, int top) {
+	if(cursor_prev == -1) {
+		graphics.set_pen(BG);
+		graphics.clear();
+		for(int i=top; i<count && i<top+cas_block_rows; i++)
+			update_cas_block_entry(i, count, top, false);
+		// The underruns of the last playback instead of the title
+		std::string_view title = str_tape_blocks;
+		if(pio_underruns.count) {
+			sprintf(temp_array, "U:%lu %lums R:%lu", (unsigned long)pio_underruns.count,
+				(unsigned long)pio_underruns.max_gap_us/1000, (unsigned long)pio_underruns.min_depth);
+			title = std::string_view(temp_array);
+		}
+		text_location.x = str_x(title.size());
+		text_location.y = 4*font_scale;
+		print_text(title);
+		Rect r(text_location.x,text_location.y+10*font_scale,title.size()*8*font_scale,2*font_scale);
+		graphics.set_pen(WHITE); graphics.rectangle(r);
+		update_buttons(main_buttons, main_buttons_size);
+	}else{
+		int i = cursor_prev;
+		while(true) {
+			update_cas_block_entry(i, count, top, true);
+			if(i == cursor_position)
+				break;
+			i = cursor_position;
+		}
+	}
+}
+
+// The blocks of the indexed (stopped) CAS image, choosing one starts the tape
+// from that block, the accelerated mode can be switched for the image here
+// too (also without the index, the block list is then empty), returns false
+// when a different file should be chosen
+bool select_cas_block() {
+	int saved_cursor_position = cursor_position;
+	int count = 0;
+	bool other_file = false;
+	int top = 0;
+
+	mutex_enter_blocking(&mount_lock);
+	for(int i=0; i<cas_chunk_count && count < CAS_INDEX_CHUNKS; i++)
+		if(cas_chunk_is_block(i))
+			cas_block_list[count++] = i;
+	mutex_exit(&mount_lock);
+	count += 2; // Other file... and the accelerated mode
+
+	cursor_prev = -1;
+	cursor_position = 0;
+	main_buttons[0].str = &char_left;
+	update_cas_blocks(count, top);
+
+	while(true) {
+		int new_position = cursor_position;
+		if(button_x.read() && cursor_position > 0) {
+			new_position--;
+		}else if(button_y.read() && cursor_position < count-1) {
+			new_position++;
+		}else if(button_b.read()) {
+			break;
+		}else if(button_a.read()) {
+			if(!cursor_position)
+				other_file = true;
+			else if(cursor_position == 1) {
+				// The times in the list change with the mode only after the
+				// next start of the tape
+				cas_accelerated = !cas_accelerated;
+				cursor_prev = cursor_position;
+				update_cas_blocks(count, top);
+				continue;
+			} else {
+				mutex_enter_blocking(&mount_lock);
+				cas_seek_chunk = cas_block_list[cursor_position-2];
+				mounts[0].mounted = true;
+				mounts[0].status = 0;
+				mutex_exit(&mount_lock);
+			}
+			break;
+		}
+		if(new_position != cursor_position) {
+			cursor_prev = cursor_position;
+			cursor_position = new_position;
+			if(cursor_position < top || cursor_position >= top + cas_block_rows) {
+				top = (cursor_position < top) ? cursor_position : cursor_position - cas_block_rows + 1;
+				cursor_prev = -1;
+			}
+			update_cas_blocks(count, top);
+		}
+		st7789.update(&graphics);
+		sleep_ms(20);
+	}
+	cursor_position = saved_cursor_position;
+	cursor_prev = -1;
+	return !other_file;
+}
+
+#ifdef TAPE_CALIBRATION
+void print_tape_timing(int t) {
+	sprintf(temp_array, "%s GP%d", t ? "Turbo" : "SIO", pin_capture_pins[t]);
+	text_location.x = 2*8*font_scale;
+	text_location.y += 8*font_scale;
+	print_text(std::string_view(temp_array));
+	for(int i=0; i<pin_capture_types; i++) {
+		pin_capture_stats_type *st = &pin_capture_stats[t][i];
+		uint32_t n = st->count + st->missing;
+		uint32_t ok = st->hist[0] + st->hist[1] + st->hist[2] + st->hist[3];
+		int32_t m = (st->err_max > -st->err_min) ? st->err_max : -st->err_min;
+		if(st->count)
+			sprintf(temp_array, "%-5s%+6ld%5ld%3lu%%", pin_capture_type_names[i], (long)(st->err_sum/(int64_t)st->count), (long)m, (unsigned long)(100*ok/n));
+		else
+			sprintf(temp_array, "%-5s   ---  --- 0%%", pin_capture_type_names[i]);
+		text_location.x = 0;
+		text_location.y += 8*font_scale;
+		print_text(std::string_view(temp_array));
+	}
+}
+
+void show_tape_timing() {
+	graphics.set_pen(BG); graphics.clear();
+	text_location.x = str_x(str_tape_timing.size());
+	text_location.y = 4*font_scale;
+	print_text(str_tape_timing, str_tape_timing.size());
+	if(mounts[0].mounted) {
+		print_text_wait(str_stop_tape);
+		return;
+	}
+	text_location.x = str_x(str_measuring.size());
+	text_location.y = str_y(1);
+	print_text(str_measuring);
+	st7789.update(&graphics);
+	pin_capture_state = pin_capture_requested;
+	while(pin_capture_state == pin_capture_requested)
+		tight_loop_contents();
+	if(pin_capture_state == pin_capture_failed) {
+		pin_capture_state = pin_capture_idle;
+		print_text_wait(str_stop_tape);
+		return;
+	}
+	pin_capture_state = pin_capture_idle;
+	graphics.set_pen(BG); graphics.clear();
+	text_location.x = str_x(str_tape_timing.size());
+	text_location.y = 4*font_scale;
+	print_text(str_tape_timing, str_tape_timing.size());
+	text_location.x = 0;
+	text_location.y += 12*font_scale;
+	print_text(str_timing_header);
+	print_tape_timing(0);
+	print_tape_timing(1);
+	st7789.update(&graphics);
+	while(!(button_a.read() || button_b.read() || button_x.read() || button_y.read())) tight_loop_contents();
+}
+#endif
+
+void print_stats_line() {
+	text_location.x = str_x(strlen(temp_array));
+	text_location.y += 10*font_scale;
+	print_text(std::string_view(temp_array));
+}
+
+// The counters kept by the SIO side, press X on the About screen
+void show_stats() {
+	graphics.set_pen(BG); graphics.clear();
+	text_location.x = str_x(str_stats.size());
+	text_location.y = 4*font_scale;
+	print_text(str_stats, str_stats.size());
+	text_location.y += 6*font_scale;
+
+	sprintf(temp_array, "Cache hits: %lu", (unsigned long)disk_cache_hits);
+	print_stats_line();
+	sprintf(temp_array, "Cache miss: %lu", (unsigned long)disk_cache_misses);
+	print_stats_line();
+	// Tape signal items handed to the DMA per its interrupt
+	uint32_t irqs = pio_dma_irqs;
+	uint32_t items = irqs ? (uint64_t)pio_dma_items*10/irqs : 0;
+	sprintf(temp_array, "Tape DMA: %lu.%lu/IRQ", (unsigned long)items/10, (unsigned long)items%10);
+	print_stats_line();
+	// System clock cycles per item, in the DMA interrupt + in the ring put
+	uint32_t n = pio_dma_items;
+	sprintf(temp_array, "Cyc/item: %lu+%lu", (unsigned long)(n ? pio_dma_irq_cycles/n : 0),
+		(unsigned long)(n ? pio_dma_put_cycles/n : 0));
+	print_stats_line();
+	// The underruns of the last tape playback, also for the tapes without
+	// the chunk index
+	sprintf(temp_array, "Underruns: %lu", (unsigned long)pio_underruns.count);
+	print_stats_line();
+	sprintf(temp_array, "Longest gap: %lums", (unsigned long)pio_underruns.max_gap_us/1000);
+	print_stats_line();
+	sprintf(temp_array, "Lowest ring: %lu", (unsigned long)pio_underruns.min_depth);
+	print_stats_line();
+	sprintf(temp_array, "WAV load: %lu%%", (unsigned long)wav_decode_load());
+	print_stats_line();
+#ifdef WAV_FILTER_CHECK
+	sprintf(temp_array, "Tone diff: %lu/%lu", (unsigned long)wav_check_diffs, (unsigned long)wav_check_samples);
+	print_stats_line();
+#endif
+
+	st7789.update(&graphics);
+	while(!(button_a.read() || button_b.read() || button_x.read() || button_y.read())) tight_loop_contents();
+}
+
 void show_about() {
 	graphics.set_pen(BG); graphics.clear();
 	text_location.x = str_x(str_about1.size());
@@ -1207,7 +1500,29 @@ void show_about() {
 	text_location.y += 10*font_scale;
 	print_text(std::string_view(temp_array));
 	st7789.update(&graphics);
-	while(!(button_a.read() || button_b.read() || button_x.read() || button_y.read())) tight_loop_contents();
+#ifdef TAPE_CALIBRATION
+	while(true) {
+		if(button_y.read()) {
+			show_tape_timing();
+			break;
+		}
+		if(button_x.read()) {
+			show_stats();
+			break;
+		}
+		if(button_a.read() || button_b.read())
+			break;
+	}
+#else
+	while(true) {
+		if(button_x.read()) {
+			show_stats();
+			break;
+		}
+		if(button_a.read() || button_b.read() || button_y.read())
+			break;
+	}
+#endif
 }
 
 void core1_entry() {
@@ -1215,6 +1530,9 @@ void core1_entry() {
 	init_io();
 #ifdef PIO_DISK_COUNTER
 	init_disk_counter();
+#endif
+#ifdef TAPE_CALIBRATION
+	init_pin_capture();
 #endif
 	main_sio_loop();
 }
@@ -1263,6 +1581,8 @@ int main() {
 		sleep_ms(1000/60);
 	}while(boot_time <= usb_boot_delay);
 
+	init_mounts();
+	set_drive_bank(0);
 	init_locks();
 
 	check_and_load_config(b_pressed);
@@ -1293,6 +1613,9 @@ int main() {
 	if(curr_path[0])
 		f_closedir(&dir);
 
+	// The WAV decoding runs here, in a low priority interrupt
+	init_wav_decode();
+
 	multicore_launch_core1(core1_entry);
 
 #ifdef CORE1_PRIORITY
@@ -1325,11 +1648,10 @@ int main() {
 			if(d == -1) {
 				if(cursor_position == 0) {
 					change_options();
-				}else if(cursor_position == 5 || cursor_position == 6) {
-					int si = (cursor_position - 5) ? 4 : 1;
-					int li = (cursor_position - 5) ? 1 : 4;
+				}else if((cursor_position == 5 || cursor_position == 6) && disk_cache_sync_lock()) {
+					int si = (cursor_position - 5) ? DRIVE_COUNT : 1;
+					int li = (cursor_position - 5) ? 1 : DRIVE_COUNT;
 					int di = (cursor_position - 5) ? -1 : 1;
-					mutex_enter_blocking(&mount_lock);
 					memcpy(temp_array, &mounts[si].str[3], 13);
 					memcpy(&temp_array[16], (const void *)mounts[si].mount_path, 256);
 					bool t = mounts[si].mounted;
@@ -1356,6 +1678,9 @@ int main() {
 					cursor_prev = -1;
 				}
 				update_main_menu();
+			}else if(!d && !mounts[0].mounted && mounts[0].mount_path[0] && select_cas_block()) {
+				last_cas_offset = -1;
+				update_main_menu();
 			}else{
 				file_type new_ft = menu_to_type[cursor_position];
 				if(ft != new_ft) {
@@ -1372,27 +1697,43 @@ int main() {
 			if(d != -1) {
 				if(!d && wav_sample_size && mounts[d].mounted)
 					flush_pio();
-				mutex_enter_blocking(&mount_lock);
-				if(mounts[d].mounted) {
-					f_close(&mounts[d].fil);
-					mounts[d].status = 0;
-					mounts[d].mounted = false;
-					blue_blinks = 0;
-					update_rgb_led(false);
-				} else {
-					if(mounts[d].mount_path[0]) {
-						mounts[d].mounted = true;
+				if(!d)
+					mutex_enter_blocking(&mount_lock);
+				// On a failed write out the drive is already being unmounted by core 1
+				if(!d || disk_cache_sync_lock()) {
+					if(mounts[d].mounted) {
+						f_close(&mounts[d].fil);
 						mounts[d].status = 0;
-						if(!d) last_cas_offset = -1;
+						mounts[d].mounted = false;
+						blue_blinks = 0;
+						update_rgb_led(false);
+					} else {
+						if(mounts[d].mount_path[0]) {
+							mounts[d].mounted = true;
+							mounts[d].status = 0;
+							if(!d) last_cas_offset = -1;
+						}
 					}
+					mutex_exit(&mount_lock);
 				}
-				mutex_exit(&mount_lock);
+			} else if(drive_bank_count > 1 && (cursor_position == 5 || cursor_position == 6)) {
+				set_drive_bank((drive_bank + (cursor_position == 5 ? drive_bank_count-1 : 1)) % drive_bank_count);
+				cursor_prev = -1;
+				update_main_menu();
 			}
 		}
-		FSIZE_t s = mounts[0].status >> 8;
+		// With the chunk index of a CAS image the tape counter goes by the playback time,
+		// the index is replaced by core 1 on a mount
+		mutex_enter_blocking(&mount_lock);
+		bool cas_timed = cas_chunk_count && cas_times_ready && !wav_sample_size && mounts[0].mount_path[0];
+		FSIZE_t s = cas_timed ? cas_time(mounts[0].status)/1000 : mounts[0].status >> 8;
+		FSIZE_t sl = cas_timed ? cas_total_time/1000 : cas_size >> 8;
+		mutex_exit(&mount_lock);
 		if(cursor_prev == -1 || (mounts[0].mounted && s != last_cas_offset)) {
 			if(s < 0) s = 0;
-			cas_pg.update(cas_pg_width*s/(cas_size >> 8));
+			cas_pg.update(sl ? cas_pg_width*s/sl : 0);
+			print_cas_time(4*font_scale, cas_timed ? s : -1);
+			print_cas_time(st7789.width-(5*8+2)*font_scale, cas_timed ? sl : -1);
 			last_cas_offset = s;
 		}
 		update_main_menu_buttons();
@@ -1417,6 +1758,7 @@ int main() {
 		graphics.set_font(&symbol_font);
 		for(int i=0; i<5; i++) {
 			d = mount_to_menu[i];
+			int m = menu_to_mount[d];
 
 			text_location.x = menu_entries[d].x-10*font_scale;
 			text_location.y = menu_entries[d].y;
@@ -1424,9 +1766,12 @@ int main() {
 			Rect rr(text_location.x,text_location.y,8*font_scale,8*font_scale);
 			graphics.rectangle(rr);
 
-			bool mntd = mounts[i].mounted;
+			if(m == -1)
+				continue;
+
+			bool mntd = mounts[m].mounted;
 
-			graphics.set_pen(mntd ? (i == last_drive ? GREEN : BG) : RED);
+			graphics.set_pen(mntd ? (m == last_drive ? GREEN : BG) : RED);
 
 			graphics.text(mntd ? ")" : "-", text_location, st7789.width, 1, 0.0, 0, true);
 			text_location.x += 8;
@@ -16,6 +16,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <algorithm>
 
 #include "pico/multicore.h"
 #include "pico/time.h"
@@ -25,28 +26,17 @@
 #include "led_indicator.hpp"
 #include "file_load.hpp"
 #include "io.hpp"
+#include "disk_cache.hpp"
+#include "ram_arena.hpp"
 
-char d1_mount[MAX_PATH_LEN] = {0};
-char d2_mount[MAX_PATH_LEN] = {0};
-char d3_mount[MAX_PATH_LEN] = {0};
-char d4_mount[MAX_PATH_LEN] = {0};
-char c_mount[MAX_PATH_LEN] = {0};
+char mount_paths[DRIVE_COUNT+1][MAX_PATH_LEN] = {0};
 
-char str_d1[] = "D1:  <EMPTY>   ";
-char str_d2[] = "D2:  <EMPTY>   ";
-char str_d3[] = "D3:  <EMPTY>   ";
-char str_d4[] = "D4:  <EMPTY>   ";
+char str_drives[DRIVE_COUNT][16];
 char str_cas[] = "C:  <EMPTY>   ";
 
-mounts_type mounts[] = {
-	{.str=str_cas, .mount_path=c_mount, .mounted=false, .status = 0},
-	{.str=str_d1, .mount_path=d1_mount, .mounted=false, .status = 0},
-	{.str=str_d2, .mount_path=d2_mount, .mounted=false, .status = 0},
-	{.str=str_d3, .mount_path=d3_mount, .mounted=false, .status = 0},
-	{.str=str_d4, .mount_path=d4_mount, .mounted=false, .status = 0}
-};
+mounts_type mounts[DRIVE_COUNT+1];
 
-disk_header_type disk_headers[4];
+disk_header_type disk_headers[DRIVE_COUNT];
 
 uint8_t sector_buffer[sector_buffer_size];
 
@@ -65,10 +55,55 @@ uint8_t cas_fsk_bit;
 
 volatile FSIZE_t cas_size;
 
+static cas_chunk_type cas_chunks_static[CAS_INDEX_CHUNKS];
+cas_chunk_type *cas_chunks = cas_chunks_static; // or in the RAM arena
+int cas_chunk_count = 0; // 0 when the image is not indexed
+uint32_t cas_total_time = 0; // in ms
+volatile bool cas_times_ready = false; // the chunk times and the total are known
+// Where the chunks not in the index (if it got full) start, and their time
+static FSIZE_t cas_index_end = 0;
+static uint32_t cas_index_end_time = 0;
+volatile int cas_seek_chunk = -1;
+volatile bool cas_accelerated = false;
+static uint16_t cas_baud = 600;
+static int cas_chunk_next = 0;
+static uint8_t *cas_ram = NULL;
+
+#if CAS_INDEX_CHUNKS > 0
+// The chunk time scan, see cas_time_scan()
+#define cas_scan_piece 1020
+
+typedef struct {
+	bool pending;
+	bool in_chunk; // the data of the chunk is being read
+	int chunk; // number of the chunk being timed
+	FSIZE_t offset; // of its header
+	uint pos; // of its data read so far
+	uint64_t samples;
+	cas_header_type header;
+	uint32_t time;
+	uint32_t baud;
+	uint32_t pwm_rate;
+} cas_scan_type;
+
+static cas_scan_type cas_scan;
+#endif
+
 FATFS fatfs[2];
 
 mutex_t fs_lock, mount_lock;
 
+void init_mounts() {
+	mounts[0].str = str_cas;
+	mounts[0].mount_path = mount_paths[0];
+	for(int i=1; i<=DRIVE_COUNT; i++) {
+		// D1: to D9:, DJ: to DO: after that
+		sprintf(str_drives[i-1], "D%c:  <EMPTY>   ", i < 10 ? '0'+i : 'A'+i-1);
+		mounts[i].str = str_drives[i-1];
+		mounts[i].mount_path = mount_paths[i];
+	}
+}
+
 void init_locks() {
 	mutex_init(&fs_lock);
 	mutex_init(&mount_lock);
@@ -78,15 +113,17 @@ void mount_file(char *f, int drive_number, char *lfn) {
 	int j;
 	bool read_only = false;
 
-	if(!drive_number)
+	if(!drive_number) {
 		flush_pio();
-
-	mutex_enter_blocking(&mount_lock);
+		cas_accelerated = false;
+		mutex_enter_blocking(&mount_lock);
+	} else if(!disk_cache_sync_lock())
+		return;
 
 	if(mounts[drive_number].mounted)
 		f_close(&mounts[drive_number].fil);
 	if(drive_number) {
-		for(j=1; j<=4; j++) {
+		for(j=1; j<=DRIVE_COUNT; j++) {
 			if(j == drive_number)
 				continue;
 			if(!strcmp(mounts[j].mount_path, curr_path)) {
@@ -124,6 +161,25 @@ FRESULT mounted_file_transfer(int drive_number, FSIZE_t offset, FSIZE_t to_trans
 	uint bytes_transferred;
 	uint8_t *data = &sector_buffer[t_offset];
 
+	if(!drive_number) {
+		if(cas_ram && !op_write) {
+			if(offset + to_transfer > cas_size)
+				return FR_INT_ERR;
+			memcpy(data, &cas_ram[offset], to_transfer);
+			return FR_OK;
+		}
+	} else {
+		if(disk_cache_ram_transfer(drive_number, offset, to_transfer, op_write, data, brpt))
+			return FR_OK;
+		if(op_write) {
+			disk_cache_invalidate(drive_number);
+			if(brpt == 1 && disk_cache_write(drive_number, offset, to_transfer, data))
+				return FR_OK;
+		} else if(disk_cache_read_back(drive_number, offset, to_transfer, data))
+			return FR_OK;
+		if((f_op_stat = disk_cache_write_back_prepare(drive_number, offset, to_transfer*brpt)) != FR_OK)
+			return f_op_stat;
+	}
 	mutex_enter_blocking(&fs_lock);
 	do {
 		//if((f_op_stat = f_mount(&fatfs[0], (const char *)mounts[drive_number].mount_path, 1)) != FR_OK)
@@ -159,38 +215,412 @@ FRESULT mounted_file_transfer(int drive_number, FSIZE_t offset, FSIZE_t to_trans
 	return f_op_stat;
 }
 
-FSIZE_t cas_read_forward(FSIZE_t offset) {
+// Whole CAS images in RAM and the chunk index. The chunk headers are read
+// from the index if there is one, then from the RAM image, and only then from
+// the file, so that the chunk boundaries do not wait for the media.
+
+// The chunk header (and the parameter of a pwms chunk) at the given offset
+static bool cas_read_header(FSIZE_t offset, uint16_t *param) {
+	if(cas_chunk_count) {
+		int i = cas_chunk_next;
+		if(i >= cas_chunk_count || cas_chunks[i].offset != offset) {
+			// Not the next one in sequence, look it up
+			int lo = 0, hi = cas_chunk_count-1;
+			i = -1;
+			while(lo <= hi) {
+				int m = (lo + hi) / 2;
+				if(cas_chunks[m].offset == offset) {
+					i = m;
+					break;
+				}
+				if(cas_chunks[m].offset < offset)
+					lo = m + 1;
+				else
+					hi = m - 1;
+			}
+			if(i < 0 && offset < cas_index_end)
+				return false;
+		}
+		if(i >= 0) {
+			cas_header = cas_chunks[i].header;
+			*param = cas_chunks[i].param;
+			cas_chunk_next = i + 1;
+			return true;
+		}
+	}
+	if(cas_ram) {
+		if(offset + sizeof(cas_header_type) > cas_size)
+			return false;
+		memcpy(&cas_header, &cas_ram[offset], sizeof(cas_header_type));
+		if(cas_header.signature == cas_header_pwms) {
+			if(offset + sizeof(cas_header_type) + sizeof(uint16_t) > cas_size)
+				return false;
+			memcpy(param, &cas_ram[offset + sizeof(cas_header_type)], sizeof(uint16_t));
+		}
+		return true;
+	}
+	FIL* fil = &mounts[0].fil;
+	uint bytes_read;
+	if(f_lseek(fil, offset) != FR_OK || f_read(fil, &cas_header, sizeof(cas_header_type), &bytes_read) != FR_OK || bytes_read != sizeof(cas_header_type))
+		return false;
+	if(cas_header.signature == cas_header_pwms &&
+			(f_read(fil, param, sizeof(uint16_t), &bytes_read) != FR_OK || bytes_read != sizeof(uint16_t)))
+		return false;
+	return true;
+}
+
+// The index of a stopped tape is kept for the block list
+void cas_unmount(bool keep_index) {
+	ram_arena_free(cas_ram);
+	cas_ram = NULL;
+	if(keep_index)
+		return;
+	cas_chunk_count = 0;
+	cas_chunk_next = 0;
+	cas_total_time = 0;
+	cas_times_ready = false;
+#if CAS_INDEX_CHUNKS > 0
+	cas_scan.pending = false;
+#endif
+	cas_index_end = 0;
+	cas_index_end_time = 0;
+	if(cas_chunks != cas_chunks_static) {
+		ram_arena_free(cas_chunks);
+		cas_chunks = cas_chunks_static;
+	}
+}
+
+// Accelerated tape mode, only the standard data chunks (around 600 baud) get
+// their gaps shortened and their baud rate changed, everything else (fsk and
+// pwm chunks, data at other rates) is timing critical and is played exactly
+static bool cas_fast_data(uint32_t baud) {
+	return cas_accelerated && baud >= 540 && baud <= 660;
+}
+
+static uint32_t cas_data_silence(uint32_t silence, uint32_t baud) {
+	if(cas_fast_data(baud) && silence > CAS_FAST_GAP_MS)
+		silence = CAS_FAST_GAP_MS;
+	return silence;
+}
+
+static uint32_t cas_data_baud(uint32_t baud) {
+#if CAS_FAST_BAUD > 0
+	if(cas_fast_data(baud))
+		baud = CAS_FAST_BAUD;
+#endif
+	return baud;
+}
+
+// The samples of a piece of the chunk data (the piece size keeps the 2 and 3
+// byte items whole)
+static uint64_t cas_chunk_samples(cas_header_type *h, uint8_t *data, uint n) {
+	uint64_t samples = 0;
+	for(uint i=0; i < n; ) {
+		switch(h->signature) {
+			case cas_header_fsk:
+			case cas_header_pwml:
+				if(i + 1 < n)
+					samples += data[i] | (data[i+1] << 8);
+				i += 2;
+				break;
+			case cas_header_pwmc:
+				if(i + 2 < n)
+					samples += data[i] * (data[i+1] | (data[i+2] << 8));
+				i += 3;
+				break;
+			default:
+				for(int j=0; j<8; j++)
+					samples += h->aux.aux_b[(data[i] >> j) & 0x1];
+				i++;
+				break;
+		}
+	}
+	return samples;
+}
+
+// The playback time of a chunk in ms, the ones with variable length pulses
+// go by the samples of their data
+static uint32_t cas_chunk_time(cas_header_type *h, uint64_t samples, uint32_t baud, uint32_t pwm_rate) {
+	uint32_t silence = h->aux.aux_w;
+	switch(h->signature) {
+		case cas_header_data:
+			return cas_data_silence(silence, baud) + h->chunk_length*10000u/cas_data_baud(baud);
+		case cas_header_fsk:
+			// 100us units
+			return silence + samples/10;
+		case cas_header_pwml:
+		case cas_header_pwmc:
+		case cas_header_pwmd:
+			if(!pwm_rate)
+				return 0;
+			if(h->signature == cas_header_pwmd)
+				silence = 0;
+			return silence + samples*1000/pwm_rate;
+		default:
+			return 0;
+	}
+}
+
+static bool cas_chunk_has_samples(cas_header_type *h) {
+	switch(h->signature) {
+		case cas_header_fsk:
+		case cas_header_pwml:
+		case cas_header_pwmc:
+		case cas_header_pwmd:
+			return h->chunk_length != 0;
+		default:
+			return false;
+	}
+}
+
+#if CAS_INDEX_CHUNKS > 0
+// The number of chunks from the given one to the end of the image, 0 if the
+// headers are not all readable
+static int cas_count_chunks(FSIZE_t offset) {
+	cas_header_type h = cas_header;
+	int n = 0;
+	uint16_t param;
+	while(offset + sizeof(cas_header_type) <= cas_size) {
+		if(!cas_read_header(offset, &param)) {
+			n = 0;
+			break;
+		}
+		n++;
+		offset += sizeof(cas_header_type) + cas_header.chunk_length;
+	}
+	cas_header = h;
+	return n;
+}
+#endif
+
+#if CAS_INDEX_CHUNKS > 0
+
+// The playback times of the chunks are worked out after the mount, in steps
+// from the SIO loop. The fsk and pwm chunks are timed by their data, which
+// (without the image in RAM) is read from the media one piece at a time with
+// the locks taken only for that piece.
+
+// From the RAM image or from the file with the mount lock held
+static bool cas_scan_read(FSIZE_t offset, void *data, uint size) {
+	if(cas_ram) {
+		if(offset + size > cas_size)
+			return false;
+		memcpy(data, &cas_ram[offset], size);
+		return true;
+	}
+	FIL* fil = &mounts[0].fil;
+	uint bytes_read;
+	mutex_enter_blocking(&fs_lock);
+	bool r = f_lseek(fil, offset) == FR_OK && f_read(fil, data, size, &bytes_read) == FR_OK && bytes_read == size;
+	mutex_exit(&fs_lock);
+	return r;
+}
+
+static void cas_scan_stop(bool done) {
+	cas_scan.pending = false;
+	if(!done)
+		return;
+	cas_total_time = cas_scan.time;
+	if(cas_index_end == cas_size)
+		cas_index_end_time = cas_scan.time;
+	cas_times_ready = true;
+}
+
+// One step, at most one read from the media
+static void cas_scan_step() {
+	while(!cas_scan.in_chunk) {
+		if(cas_scan.offset + sizeof(cas_header_type) > cas_size) {
+			cas_scan_stop(true);
+			return;
+		}
+		uint16_t param = 0;
+		bool read = false;
+		if(cas_scan.chunk < cas_chunk_count) {
+			cas_scan.header = cas_chunks[cas_scan.chunk].header;
+			param = cas_chunks[cas_scan.chunk].param;
+			cas_chunks[cas_scan.chunk].time = cas_scan.time;
+		} else {
+			read = !cas_ram;
+			if(!cas_scan_read(cas_scan.offset, &cas_scan.header, sizeof(cas_header_type)) ||
+					(cas_scan.header.signature == cas_header_pwms &&
+					!cas_scan_read(cas_scan.offset + sizeof(cas_header_type), &param, sizeof(uint16_t)))) {
+				cas_scan_stop(false);
+				return;
+			}
+		}
+		if(cas_scan.offset == cas_index_end)
+			cas_index_end_time = cas_scan.time;
+		if(cas_scan.header.signature == cas_header_baud && cas_scan.header.aux.aux_w)
+			cas_scan.baud = cas_scan.header.aux.aux_w;
+		else if(cas_scan.header.signature == cas_header_pwms)
+			cas_scan.pwm_rate = param;
+		if(cas_chunk_has_samples(&cas_scan.header)) {
+			cas_scan.in_chunk = true;
+			cas_scan.pos = 0;
+			cas_scan.samples = 0;
+		} else {
+			cas_scan.time += cas_chunk_time(&cas_scan.header, 0, cas_scan.baud, cas_scan.pwm_rate);
+			cas_scan.offset += sizeof(cas_header_type) + cas_scan.header.chunk_length;
+			cas_scan.chunk++;
+		}
+		if(read)
+			return;
+	}
+	uint len = cas_scan.header.chunk_length;
+	uint n = std::min(len - cas_scan.pos, (uint)cas_scan_piece);
+	if(!cas_scan_read(cas_scan.offset + sizeof(cas_header_type) + cas_scan.pos, sector_buffer, n)) {
+		cas_scan_stop(false);
+		return;
+	}
+	cas_scan.samples += cas_chunk_samples(&cas_scan.header, sector_buffer, n);
+	cas_scan.pos += n;
+	if(cas_scan.pos == len) {
+		cas_scan.time += cas_chunk_time(&cas_scan.header, cas_scan.samples, cas_scan.baud, cas_scan.pwm_rate);
+		cas_scan.offset += sizeof(cas_header_type) + len;
+		cas_scan.chunk++;
+		cas_scan.in_chunk = false;
+	}
+}
+
+// Called from the SIO loop without any locks, false when there is nothing to
+// do (also with the tape stopped, the scan goes on after it is mounted again)
+bool cas_time_scan() {
+	if(!cas_scan.pending)
+		return false;
+	bool r = false;
+	mutex_enter_blocking(&mount_lock);
+	if(mounts[0].mounted && mounts[0].status) {
+		cas_scan_step();
+		r = true;
+	}
+	mutex_exit(&mount_lock);
+	return r;
+}
+
+#else
+
+bool cas_time_scan() {
+	return false;
+}
+
+#endif
+
+// Called on mount of a CAS image with both the mount and the file system lock
+// held, only the chunk headers are read here, on any failure the image is
+// played from the file as before
+void cas_mount() {
 	FIL* fil = &mounts[0].fil;
 	uint bytes_read;
-	if(f_lseek(fil, offset) != FR_OK) {
-		offset = 0;
-		goto cas_read_forward_exit;
+
+	cas_unmount(false);
+	cas_baud = 600;
+	if(cas_size <= CAS_RAM_MAX_SIZE && (cas_ram = (uint8_t *)ram_arena_alloc(cas_size)) != NULL &&
+			(f_lseek(fil, 0) != FR_OK || f_read(fil, cas_ram, cas_size, &bytes_read) != FR_OK || bytes_read != cas_size)) {
+		ram_arena_free(cas_ram);
+		cas_ram = NULL;
+	}
+#if CAS_INDEX_CHUNKS > 0
+	FSIZE_t offset = 0;
+	int n = 0;
+	int n_max = CAS_INDEX_CHUNKS;
+	cas_index_end = cas_size;
+	while(offset + sizeof(cas_header_type) <= cas_size) {
+		uint16_t param = 0;
+		if(!cas_read_header(offset, &param)) {
+			n = 0;
+			break;
+		}
+		if(n == n_max && cas_chunks == cas_chunks_static) {
+			// Move the index to the RAM arena sized for the whole image
+			int m = cas_count_chunks(offset);
+			cas_chunk_type *c = (m > 0) ? (cas_chunk_type *)ram_arena_alloc((n+m)*sizeof(cas_chunk_type)) : NULL;
+			if(c) {
+				memcpy(c, cas_chunks, n*sizeof(cas_chunk_type));
+				cas_chunks = c;
+				n_max = n+m;
+			}
+		}
+		if(n < n_max) {
+			cas_chunks[n].offset = offset;
+			cas_chunks[n].header = cas_header;
+			cas_chunks[n].param = param;
+			cas_chunks[n].time = 0;
+			n++;
+		} else if(cas_index_end == cas_size)
+			// Otherwise the rest of the image goes without the index
+			cas_index_end = offset;
+		offset += sizeof(cas_header_type) + cas_header.chunk_length;
+	}
+	if(!n) {
+		if(cas_chunks != cas_chunks_static)
+			ram_arena_free(cas_chunks);
+		cas_chunks = cas_chunks_static;
+		cas_index_end = 0;
+	}
+	cas_chunk_count = n;
+	if(n) {
+		memset(&cas_scan, 0, sizeof(cas_scan));
+		cas_scan.baud = 600;
+		cas_scan.pending = true;
+		// Nothing to wait for with the image in RAM
+		while(cas_ram && cas_scan.pending)
+			cas_scan_step();
+	}
+#endif
+	f_lseek(fil, 0);
+}
+
+// The state set up by the baud and pwms chunks, false if the chunk is not valid
+static bool cas_set_params(uint16_t param) {
+	switch(cas_header.signature) {
+		case cas_header_baud:
+			if(cas_header.chunk_length)
+				return false;
+			cas_baud = cas_header.aux.aux_w;
+			cas_sample_duration = (timing_base_clock+cas_baud/2)/cas_baud;
+			break;
+		case cas_header_pwms:
+			if(cas_header.chunk_length != 2)
+				return false;
+			pwm_bit_order = (cas_header.aux.aux_b[0] >> 2) & 0x1;
+			cas_header.aux.aux_b[0] &= 0x3;
+			if(cas_header.aux.aux_b[0] == 0b01)
+				pwm_bit = 0; // 0
+			else if(cas_header.aux.aux_b[0] == 0b10)
+				pwm_bit = 1; // 1
+			else
+				return false;
+			pwm_sample_duration = (timing_base_clock+param/2)/param;
+			break;
+		default:
+			break;
 	}
+	return true;
+}
+
+FSIZE_t cas_read_forward(FSIZE_t offset) {
+	uint16_t param;
 	while(true) {
-		if(f_read(fil, &cas_header, sizeof(cas_header_type), &bytes_read) != FR_OK || bytes_read != sizeof(cas_header_type)) {
+		if(!cas_read_header(offset, &param)) {
 			offset = 0;
 			goto cas_read_forward_exit;
 		}
-		offset += bytes_read;
+		offset += sizeof(cas_header_type);
 		cas_block_index = 0;
 		switch(cas_header.signature) {
 			case cas_header_FUJI:
 				offset += cas_header.chunk_length;
-				if(f_lseek(fil, offset) != FR_OK) {
-					offset = 0;
-					goto cas_read_forward_exit;
-				}
 				break;
 			case cas_header_baud:
-				if(cas_header.chunk_length) {
+				if(!cas_set_params(param)) {
 					offset = 0;
 					goto cas_read_forward_exit;
 				}
-				cas_sample_duration = (timing_base_clock+cas_header.aux.aux_w/2)/cas_header.aux.aux_w;
 				break;
 			case cas_header_data:
 				cas_block_turbo = false;
-				silence_duration = cas_header.aux.aux_w;
+				silence_duration = cas_data_silence(cas_header.aux.aux_w, cas_baud);
+				cas_sample_duration = (timing_base_clock+cas_data_baud(cas_baud)/2)/cas_data_baud(cas_baud);
 				cas_block_multiple = 1;
 				goto cas_read_forward_exit;
 			case cas_header_fsk:
@@ -200,27 +630,11 @@ FSIZE_t cas_read_forward(FSIZE_t offset) {
 				cas_fsk_bit = 0;
 				goto cas_read_forward_exit;
 			case cas_header_pwms:
-				if(cas_header.chunk_length != 2) {
-					offset = 0;
-					goto cas_read_forward_exit;
-				}
-				pwm_bit_order = (cas_header.aux.aux_b[0] >> 2) & 0x1;
-				cas_header.aux.aux_b[0] &= 0x3;
-				if(cas_header.aux.aux_b[0] == 0b01)
-					pwm_bit = 0; // 0
-				else if(cas_header.aux.aux_b[0] == 0b10)
-					pwm_bit = 1; // 1
-				else {
+				if(!cas_set_params(param)) {
 					offset = 0;
 					goto cas_read_forward_exit;
 				}
-				pwm_sample_duration = 0;
-				if(f_read(fil, &pwm_sample_duration, sizeof(uint16_t), &bytes_read) != FR_OK || bytes_read != sizeof(uint16_t)) {
-					offset = 0;
-					goto cas_read_forward_exit;
-				}
-				offset += bytes_read;
-				pwm_sample_duration = (timing_base_clock+pwm_sample_duration/2)/pwm_sample_duration;
+				offset += sizeof(uint16_t);
 				break;
 			case cas_header_pwmc:
 				cas_block_turbo = true;
@@ -238,6 +652,8 @@ FSIZE_t cas_read_forward(FSIZE_t offset) {
 				cas_fsk_bit = pwm_bit;
 				goto cas_read_forward_exit;
 			default:
+				// Unknown chunks are skipped
+				offset += cas_header.chunk_length;
 				break;
 		}
 	}
@@ -245,6 +661,61 @@ cas_read_forward_exit:
 	return offset;
 }
 
+// Start the playback at the given chunk of the index, with the parameters set
+// up by the chunks before it
+FSIZE_t cas_seek(int chunk) {
+	if(chunk >= cas_chunk_count)
+		return 0;
+	cas_baud = 600;
+	for(int i=0; i<chunk; i++) {
+		cas_header = cas_chunks[i].header;
+		if(!cas_set_params(cas_chunks[i].param))
+			return 0;
+	}
+	return cas_read_forward(cas_chunks[chunk].offset);
+}
+
+// Playback time in ms at the given offset of the image, within a chunk it is
+// proportional to the part of the chunk data that has been read
+uint32_t cas_time(FSIZE_t offset) {
+	int n = cas_chunk_count;
+	if(!n)
+		return 0;
+	int lo = 0, hi = n-1;
+	while(lo < hi) {
+		int m = (lo + hi + 1) / 2;
+		if(cas_chunks[m].offset < offset)
+			lo = m;
+		else
+			hi = m - 1;
+	}
+	cas_chunk_type *c = &cas_chunks[lo];
+	uint32_t t0 = c->time;
+	// Past the index (if it got full) the time goes by the image offset
+	if(offset > cas_index_end && cas_size > cas_index_end)
+		return cas_index_end_time + (uint64_t)(cas_total_time - cas_index_end_time)*(offset - cas_index_end)/(cas_size - cas_index_end);
+	uint32_t t1 = (lo + 1 < n) ? cas_chunks[lo+1].time : cas_index_end_time;
+	FSIZE_t data_offset = c->offset + sizeof(cas_header_type);
+	if(offset <= data_offset || !c->header.chunk_length)
+		return t0;
+	if(offset >= data_offset + c->header.chunk_length)
+		return t1;
+	return t0 + (uint64_t)(t1 - t0)*(offset - data_offset)/c->header.chunk_length;
+}
+
+bool cas_chunk_is_block(int i) {
+	switch(cas_chunks[i].header.signature) {
+		case cas_header_data:
+		case cas_header_fsk:
+		case cas_header_pwmc:
+		case cas_header_pwmd:
+		case cas_header_pwml:
+			return true;
+		default:
+			return false;
+	}
+}
+
 volatile uint8_t sd_card_present = 0;
 const char * const volume_names[] = {"0:", "1:"};
 const char * const str_int_flash = "Pico FLASH";
@@ -282,7 +753,7 @@ void update_last_drive(uint drive_number) {
 }
 
 int last_access_error_drive = -1;
-bool last_access_error[5] = {false};
+bool last_access_error[DRIVE_COUNT+1] = {false};
 
 void set_last_access_error(int drive_number) {
 	last_access_error_drive = drive_number;
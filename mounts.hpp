@@ -71,10 +71,6 @@ typedef union {
 enum file_type {none, disk, casette};
 extern file_type ft;
 
-extern char str_d1[];
-extern char str_d2[];
-extern char str_d3[];
-extern char str_d4[];
 extern char str_cas[];
 
 extern mounts_type mounts[];
@@ -83,6 +79,7 @@ extern disk_header_type disk_headers[];
 #define disk_type_atr 1
 #define disk_type_xex 2
 #define disk_type_atx 3
+#define disk_type_cas 4
 
 #ifdef WAV_96K
 #define sector_buffer_size 2048
@@ -106,11 +103,26 @@ extern uint8_t cas_fsk_bit;
 
 extern volatile FSIZE_t cas_size;
 
+typedef struct {
+	uint32_t offset; // of the chunk header
+	cas_header_type header;
+	uint16_t param; // the sample rate of a pwms chunk
+	uint32_t time; // playback time up to the chunk in ms
+} cas_chunk_type;
+
+extern cas_chunk_type *cas_chunks;
+extern int cas_chunk_count;
+extern uint32_t cas_total_time;
+extern volatile bool cas_times_ready;
+extern volatile int cas_seek_chunk;
+extern volatile bool cas_accelerated;
+
 extern FATFS fatfs[];
 
 extern mutex_t fs_lock;
 extern mutex_t mount_lock;
 
+void init_mounts();
 void init_locks();
 
 #define cas_header_FUJI 0x494A5546
@@ -128,6 +140,10 @@ void init_locks();
 #define WAV_DATA 0x61746164
 #define WAV_LIST 0x5453494C
 
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_MS_ADPCM 0x0002
+#define WAV_FORMAT_IMA_ADPCM 0x0011
+
 void get_drive_label(int i);
 
 uint8_t try_mount_sd();
@@ -136,7 +152,13 @@ void mount_file(char *f, int drive_number, char *lfn);
 
 FRESULT mounted_file_transfer(int drive_number, FSIZE_t offset, FSIZE_t to_transfer, bool op_write, size_t t_offset=0, FSIZE_t brpt=1);
 
+void cas_mount();
+void cas_unmount(bool keep_index);
 FSIZE_t cas_read_forward(FSIZE_t offset);
+FSIZE_t cas_seek(int chunk);
+uint32_t cas_time(FSIZE_t offset);
+bool cas_time_scan();
+bool cas_chunk_is_block(int i);
 
 extern volatile uint8_t sd_card_present;
 extern const char * const volume_names[];
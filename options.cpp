@@ -38,11 +38,16 @@ uint8_t current_options[option_count] = {
 
 volatile bool save_config_flag = false;
 volatile bool save_path_flag = false;
+volatile bool save_hsio_auto_flag = false;
+
+// The auto-tuned HSIO option for the PAL and NTSC host clock
+uint8_t hsio_auto_index[2] = {hsio_auto_index_max, hsio_auto_index_max};
 
 #define flash_save_offset (HW_FLASH_STORAGE_BASE-FLASH_SECTOR_SIZE)
 
 const uint8_t *flash_config_pointer = (uint8_t *)(XIP_BASE+flash_save_offset);
 #define flash_config_offset MAX_PATH_LEN
+#define flash_hsio_auto_offset (flash_config_offset+32)
 #define flash_check_sig_offset (flash_config_offset+64)
 #define config_magic 0xDEADBEEF
 
@@ -50,6 +55,12 @@ void check_and_load_config(bool reset_config) {
 	if(!reset_config && *(uint32_t *)&flash_config_pointer[flash_check_sig_offset] == config_magic) {
 		memcpy(curr_path, &flash_config_pointer[0], MAX_PATH_LEN);
 		memcpy(current_options, &flash_config_pointer[flash_config_offset], option_count);
+		for(int i=0; i<2; i++) {
+			uint8_t s = flash_config_pointer[flash_hsio_auto_offset+i];
+			// Configurations saved before auto-tuning have 0 here
+			if(s && s <= hsio_auto_index_max)
+				hsio_auto_index[i] = s;
+		}
 	} else {
 		save_path_flag = true;
 		save_config_flag = true;
@@ -57,11 +68,12 @@ void check_and_load_config(bool reset_config) {
 }
 
 void check_and_save_config() {
-	if(!save_path_flag && !save_config_flag)
+	if(!save_path_flag && !save_config_flag && !save_hsio_auto_flag)
 		return;
 	memset(sector_buffer, 0, sector_buffer_size);
 	memcpy(sector_buffer, save_path_flag ? (uint8_t *)curr_path : &flash_config_pointer[0], MAX_PATH_LEN);
 	memcpy(&sector_buffer[flash_config_offset], save_config_flag ? current_options : (uint8_t *)&flash_config_pointer[flash_config_offset], option_count);
+	memcpy(&sector_buffer[flash_hsio_auto_offset], hsio_auto_index, 2);
 	*(uint32_t *)&sector_buffer[flash_check_sig_offset] = config_magic;
 	uint32_t ints = save_and_disable_interrupts();
 	multicore_lockout_start_blocking();
@@ -71,4 +83,5 @@ void check_and_save_config() {
 	restore_interrupts(ints);
 	save_path_flag = false;
 	save_config_flag = false;
+	save_hsio_auto_flag = false;
 }
@@ -32,9 +32,17 @@ extern uint8_t current_options[];
 #define turbo3_option_index 8
 #define wav_option_index 9
 
+// The HSIO option value for the divisor auto-tuning mode
+#define hsio_option_auto 9
+// The fastest divisor the auto-tuning starts with
+#define hsio_auto_index_max 8
+
+extern uint8_t hsio_auto_index[];
+
 extern const uint8_t *flash_config_pointer;
 extern volatile bool save_config_flag;
 extern volatile bool save_path_flag;
+extern volatile bool save_hsio_auto_flag;
 
 void check_and_load_config(bool reset_config);
 void check_and_save_config();
@@ -0,0 +1,213 @@
+/*
+ * This file is part of the a8-pico-sio project --
+ * An Atari 8-bit SIO drive and (turbo) tape emulator for
+ * Raspberry Pi Pico, see
+ *
+ *         https://github.com/woj76/a8-pico-sio
+ *
+ * For information on what / whose work it is based on, check the corresponding
+ * source files and the README file. This file is licensed under GNU General
+ * Public License 3.0 or later.
+ *
+ * Copyright (C) 2025 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+ */
+
+#include "pin_capture.hpp"
+
+#ifdef TAPE_CALIBRATION
+
+#include <string.h>
+
+#include "hardware/clocks.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/uart.h"
+
+#include "io.hpp"
+#include "mounts.hpp"
+
+#include "pin_io.pio.h"
+#include "pin_capture.pio.h"
+
+// The tape timing calibration. A test pattern of all the kinds of pulses the
+// tape player uses is sent through the regular PIO ring to the standard SIO and
+// the turbo data pins, a state machine on the other PIO block samples the same
+// pin at the full clock speed and the DMA stores the measured durations of the
+// levels. These are then compared with the requested ones, the errors include
+// the pio_*_cycle_corr corrections and the ring / DMA handling.
+
+#define capture_pio pio1
+#define pin_capture_size 512
+
+#define type_pulse 0
+#define type_byte 1
+#define type_pairs 2
+#define type_pwm_byte 3
+
+volatile uint8_t pin_capture_state = pin_capture_idle;
+pin_capture_stats_type pin_capture_stats[2][pin_capture_types];
+uint8_t pin_capture_pins[2];
+
+static uint32_t capture_buffer[pin_capture_size];
+// The requested level durations, the pulse type in the top 4 bits
+static uint32_t capture_expected[pin_capture_size];
+static uint capture_expected_count;
+static uint8_t capture_level;
+
+static uint capture_offset;
+static uint capture_sm;
+static int capture_dma_channel;
+static dma_channel_config capture_dma_config;
+
+void init_pin_capture() {
+	capture_offset = pio_add_program(capture_pio, &pin_capture_program);
+	capture_sm = pio_claim_unused_sm(capture_pio, true);
+	capture_dma_channel = dma_claim_unused_channel(true);
+	capture_dma_config = dma_channel_get_default_config(capture_dma_channel);
+	channel_config_set_transfer_data_size(&capture_dma_config, DMA_SIZE_32);
+	channel_config_set_read_increment(&capture_dma_config, false);
+	channel_config_set_write_increment(&capture_dma_config, true);
+	channel_config_set_dreq(&capture_dma_config, pio_get_dreq(capture_pio, capture_sm, false));
+}
+
+static void expect(uint8_t type, uint32_t d) {
+	if(capture_expected_count < pin_capture_size)
+		capture_expected[capture_expected_count++] = (type << 28) | d;
+	capture_level ^= 1;
+}
+
+// The level before got more cycles from the word that follows it
+static void expect_more(uint32_t c) {
+	if(capture_expected_count)
+		capture_expected[capture_expected_count-1] += c;
+}
+
+static void pattern_pulse(uint32_t d) {
+	pio_enqueue(capture_level, d);
+	expect(type_pulse, d);
+}
+
+static void pattern_byte(uint8_t b, uint32_t d) {
+	// The pattern bytes have all the levels alternating (0x55), start
+	// bit at 0 needs the line at 1 before it
+	if(capture_level)
+		pattern_pulse(d);
+	pio_enqueue_byte(b, d);
+	expect_more(pio_byte_setup_cycles);
+	for(int i=0; i<9; i++)
+		expect(type_byte, d);
+	expect(type_byte, d + pio_byte_stop_cycles);
+}
+
+static void pattern_pairs(uint32_t d, uint16_t n) {
+	pio_enqueue_pairs(capture_level, d, n);
+	for(int i=0; i<2*n; i++)
+		expect(type_pairs, d);
+	expect_more(pio_pairs_last_cycle_corr - pio_pairs_cycle_corr);
+}
+
+static void pattern_pwm_byte(uint8_t v, uint32_t d0, uint32_t d1) {
+	pio_enqueue_pwm_byte(capture_level, v, d0, d1, false);
+	for(int i=0; i<8; i++) {
+		uint32_t d = ((v >> i) & 0x1) ? d1 : d0;
+		expect(type_pwm_byte, d);
+		expect(type_pwm_byte, d);
+	}
+}
+
+static void wait_pio_idle(uint s) {
+	sleep_us(100);
+	while(!pio_sm_is_tx_fifo_empty(cas_pio, s))
+		tight_loop_contents();
+}
+
+static void pin_capture_pass(int t) {
+	uint s = t ? sm_turbo : sm;
+	uint pin = t ? turbo_data_pin : sio_tx_pin;
+	uint32_t us = timing_base_clock/1000000;
+	uint32_t i;
+
+	pin_capture_pins[t] = pin;
+	cas_block_turbo = t;
+	capture_expected_count = 0;
+
+	// Get the line to 1 before the capture starts
+	capture_level = 1;
+	while(!pio_enqueue(1, 5000*us))
+		tight_loop_contents();
+	wait_pio_idle(s);
+
+	pio_sm_config c = pin_capture_program_get_default_config(capture_offset);
+	sm_config_set_jmp_pin(&c, pin);
+	sm_config_set_in_shift(&c, false, false, 32);
+	sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
+	sm_config_set_clkdiv_int_frac(&c, 1, 0);
+	pio_sm_init(capture_pio, capture_sm, capture_offset, &c);
+	dma_channel_configure(capture_dma_channel, &capture_dma_config, capture_buffer, &capture_pio->rxf[capture_sm], pin_capture_size, true);
+	pio_sm_set_enabled(capture_pio, capture_sm, true);
+
+	capture_level = 0;
+	const uint32_t pulse_durations[] = {50, 100, 250, 500, 1000, 2000};
+	for(i=0; i<48; i++)
+		pattern_pulse(pulse_durations[i % 6]*us);
+	for(i=0; i<16; i++)
+		pattern_byte(0x55, (timing_base_clock+300)/600);
+	pattern_pairs(300*us, 16);
+	pattern_pairs(150*us, 16);
+	const uint8_t pwm_values[] = {0x00, 0xFF, 0xA5, 0x5A};
+	for(i=0; i<8; i++)
+		pattern_pwm_byte(pwm_values[i % 4], 150*us, 300*us);
+	// Close the last level, then go back to idle
+	pio_enqueue(capture_level, 5000*us);
+	pio_enqueue(t ? pwm_bit : 1, 1000*us);
+	wait_pio_idle(s);
+	sleep_ms(10);
+
+	pio_sm_set_enabled(capture_pio, capture_sm, false);
+	uint32_t captured = pin_capture_size - dma_hw->ch[capture_dma_channel].transfer_count;
+	dma_channel_abort(capture_dma_channel);
+
+	// The first captured level is a high one, the lead in could have been
+	// inverted
+	uint32_t skip = (t && turbo_conf[2]) ? 2 : 1;
+	uint32_t clk = clock_get_hz(clk_sys);
+	memset(pin_capture_stats[t], 0, sizeof(pin_capture_stats[t]));
+	for(i=0; i<capture_expected_count; i++) {
+		pin_capture_stats_type *st = &pin_capture_stats[t][capture_expected[i] >> 28];
+		if(i + skip >= captured) {
+			st->missing++;
+			continue;
+		}
+		int64_t m = (2*(uint64_t)capture_buffer[i+skip] + pin_capture_cycle_corr)*1000000000ull/clk;
+		int64_t e = (uint64_t)(capture_expected[i] & 0x0FFFFFFF)*1000000000ull/timing_base_clock;
+		int32_t err = m - e;
+		if(!st->count || err < st->err_min)
+			st->err_min = err;
+		if(!st->count || err > st->err_max)
+			st->err_max = err;
+		st->count++;
+		st->err_sum += err;
+		uint32_t a = err < 0 ? -err : err;
+		int h = 0;
+		while(h < pin_capture_hist_size-1 && a >= (125u << h))
+			h++;
+		st->hist[h]++;
+	}
+}
+
+void pin_capture_run() {
+	if(mounts[0].mounted) {
+		pin_capture_state = pin_capture_failed;
+		return;
+	}
+	flush_pio();
+	reinit_pio();
+	gpio_set_function(sio_tx_pin, GPIO_FUNC_PIOX);
+	pin_capture_pass(0);
+	pin_capture_pass(1);
+	cas_block_turbo = false;
+	gpio_set_function(sio_tx_pin, GPIO_FUNC_UART);
+	pin_capture_state = pin_capture_done;
+}
+
+#endif
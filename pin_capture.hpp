@@ -0,0 +1,50 @@
+/*
+ * This file is part of the a8-pico-sio project --
+ * An Atari 8-bit SIO drive and (turbo) tape emulator for
+ * Raspberry Pi Pico, see
+ *
+ *         https://github.com/woj76/a8-pico-sio
+ *
+ * For information on what / whose work it is based on, check the corresponding
+ * source files and the README file. This file is licensed under GNU General
+ * Public License 3.0 or later.
+ *
+ * Copyright (C) 2025 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+ */
+
+#pragma once
+
+#include "config.h"
+
+#ifdef TAPE_CALIBRATION
+
+#include <stdint.h>
+
+#define pin_capture_idle 0
+#define pin_capture_requested 1
+#define pin_capture_done 2
+#define pin_capture_failed 3
+
+// Pulse, byte, pulse pairs, PWM byte
+#define pin_capture_types 4
+// Errors below 125ns, 250ns, ..., 8us, and above
+#define pin_capture_hist_size 8
+
+typedef struct {
+	uint32_t count;
+	uint32_t missing;
+	int32_t err_min; // ns
+	int32_t err_max;
+	int64_t err_sum;
+	uint32_t hist[pin_capture_hist_size];
+} pin_capture_stats_type;
+
+extern volatile uint8_t pin_capture_state;
+// For the standard SIO and the turbo data pins
+extern pin_capture_stats_type pin_capture_stats[2][pin_capture_types];
+extern uint8_t pin_capture_pins[2];
+
+void init_pin_capture();
+void pin_capture_run();
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * This file is part of the a8-pico-sio project --
+ * An Atari 8-bit SIO drive and (turbo) tape emulator for
+ * Raspberry Pi Pico, see
+ *
+ *         https://github.com/woj76/a8-pico-sio
+ *
+ * For information on what / whose work it is based on, check the corresponding
+ * source files and the README file. This file is licensed under GNU General
+ * Public License 3.0 or later.
+ *
+ * Copyright (C) 2025 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "pico.h"
+
+#include "ram_arena.hpp"
+
+// Only the Pico 2 has the memory to spare for this
+#if defined(RASPBERRYPI_PICO2) && RAM_ARENA_SIZE > 0
+
+// At most one image and one dirty map per drive, and the cassette image and
+// its chunk index
+#define ram_arena_blocks (2*DRIVE_COUNT+2)
+
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+} ram_block_type;
+
+static uint8_t __attribute__((aligned(4))) ram_arena[RAM_ARENA_SIZE];
+// Kept sorted by offset
+static ram_block_type ram_blocks[ram_arena_blocks];
+static int ram_block_count = 0;
+
+// First fit, the arena only holds a handful of big blocks allocated on mount
+// and freed on unmount, so fragmentation is not much of a concern. Only core 1
+// allocates and frees.
+void *ram_arena_alloc(size_t size) {
+	if(!size || ram_block_count == ram_arena_blocks)
+		return NULL;
+	size = (size + 3) & ~3;
+	uint32_t offset = 0;
+	int i;
+	for(i=0; i<ram_block_count; i++) {
+		if(ram_blocks[i].offset - offset >= size)
+			break;
+		offset = ram_blocks[i].offset + ram_blocks[i].size;
+	}
+	if(offset + size > RAM_ARENA_SIZE)
+		return NULL;
+	memmove(&ram_blocks[i+1], &ram_blocks[i], (ram_block_count-i)*sizeof(ram_block_type));
+	ram_blocks[i].offset = offset;
+	ram_blocks[i].size = size;
+	ram_block_count++;
+	return &ram_arena[offset];
+}
+
+void ram_arena_free(void *p) {
+	if(!p)
+		return;
+	uint32_t offset = (uint8_t *)p - ram_arena;
+	for(int i=0; i<ram_block_count; i++)
+		if(ram_blocks[i].offset == offset) {
+			ram_block_count--;
+			memmove(&ram_blocks[i], &ram_blocks[i+1], (ram_block_count-i)*sizeof(ram_block_type));
+			return;
+		}
+}
+
+#else
+
+void *ram_arena_alloc(size_t size) { return NULL; }
+void ram_arena_free(void *p) {}
+
+#endif
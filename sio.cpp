@@ -17,6 +17,9 @@
 #include "hardware/pio.h"
 #include "hardware/pio_instructions.h"
 #include "hardware/uart.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 
 #include "sio.hpp"
 
@@ -28,6 +31,9 @@
 #include "io.hpp"
 #include "atx.hpp"
 #include "wav_decode.hpp"
+#include "wav_cache.hpp"
+#include "disk_cache.hpp"
+#include "pin_capture.hpp"
 
 #include "diskio.h"
 
@@ -73,6 +79,83 @@ static uint8_t locate_percom(int drive_number) {
 	return r;
 }
 
+// CAS images that hold nothing but the standard data records of a single file
+// mounted as a disk. A boot tape gives a boot disk with one record per sector
+// (the boot record header is the same), a binary load file is served the same
+// way as a XEX file. The records are read straight from the image.
+
+#define cas_record_size 132 // 2 sync bytes, control byte, 128 data bytes, checksum
+#define cas_record_stride (sizeof(cas_header_type)+cas_record_size)
+
+static FSIZE_t cas_disk_first[DRIVE_COUNT]; // image offset of the first record chunk
+static bool cas_disk_boot[DRIVE_COUNT];
+
+static FRESULT cas_disk_read(int drive_number, FSIZE_t offset, FSIZE_t to_read) {
+	FRESULT f_op_stat = FR_OK;
+	size_t t_offset = 0;
+	while(to_read && f_op_stat == FR_OK) {
+		FSIZE_t n = std::min(to_read, 128 - (offset & 127));
+		f_op_stat = mounted_file_transfer(drive_number,
+			cas_disk_first[drive_number-1] + (offset >> 7)*cas_record_stride + sizeof(cas_header_type) + 3 + (offset & 127),
+			n, false, t_offset);
+		offset += n;
+		t_offset += n;
+		to_read -= n;
+	}
+	return f_op_stat;
+}
+
+// Size of the file stored in the records, 0 if the image has anything else
+// (turbo or raw chunks, more than one file, broken records)
+static FSIZE_t cas_disk_scan(int drive_number) {
+	FIL *fil = &mounts[drive_number].fil;
+	cas_header_type h;
+	uint8_t rec[3];
+	FSIZE_t offset = 0, first = 0, size = 0;
+	uint bytes_read;
+	bool partial = false;
+
+	while(true) {
+		if(f_lseek(fil, offset) != FR_OK || f_read(fil, &h, sizeof(cas_header_type), &bytes_read) != FR_OK || bytes_read != sizeof(cas_header_type))
+			return 0;
+		if(h.signature == cas_header_data) {
+			if(!first)
+				first = offset;
+			if(h.chunk_length != cas_record_size || f_read(fil, rec, 3, &bytes_read) != FR_OK || bytes_read != 3 ||
+					rec[0] != 0x55 || rec[1] != 0x55)
+				return 0;
+			if(rec[2] == 0xFE) // end of file
+				break;
+			// Only the last record can be a partial one
+			if(partial)
+				return 0;
+			if(rec[2] == 0xFC)
+				size += 128;
+			else if(rec[2] == 0xFA) {
+				// The number of bytes is in the last data byte
+				if(f_lseek(fil, offset + sizeof(cas_header_type) + 3 + 127) != FR_OK || f_read(fil, rec, 1, &bytes_read) != FR_OK || bytes_read != 1)
+					return 0;
+				size += rec[0];
+				partial = true;
+			} else
+				return 0;
+		} else if(first || (h.signature != cas_header_FUJI && h.signature != cas_header_baud))
+			return 0;
+		offset += sizeof(cas_header_type) + h.chunk_length;
+	}
+	// A single file only
+	if(offset + cas_record_stride < f_size(fil) || !size)
+		return 0;
+	cas_disk_first[drive_number-1] = first;
+	if(f_lseek(fil, first + sizeof(cas_header_type) + 3) != FR_OK || f_read(fil, rec, 2, &bytes_read) != FR_OK || bytes_read != 2)
+		return 0;
+	cas_disk_boot[drive_number-1] = (rec[0] != 0xFF || rec[1] != 0xFF);
+	// The boot record header gives the number of records to load
+	if(cas_disk_boot[drive_number-1] && (!rec[1] || rec[1] > (size + 127) / 128))
+		return 0;
+	return size;
+}
+
 static bool compare_percom(int drive_number) {
 	int i = disk_headers[drive_number-1].atr_header.temp3;
 	if(i & 0x80)
@@ -96,55 +179,199 @@ static uint8_t sio_checksum(uint8_t *data, size_t len) {
 	return cksum;
 }
 
+// Send the data frame through DMA, the checksum is calculated while the data
+// is on the wire. The read-ahead cache is refilled only once the checksum byte
+// is out, a card read must not delay it beyond the Atari's timeout.
+static void send_data_frame(FSIZE_t to_send) {
+	dma_channel_transfer_from_buffer_now(uart_dma_channel, sector_buffer, to_send);
+	uint8_t cksum = sio_checksum(sector_buffer, to_send);
+	dma_channel_wait_for_finish_blocking(uart_dma_channel);
+	uart_putc_raw(uart1, cksum);
+	disk_cache_prefetch();
+}
+
+// The command frame is captured in the background: the falling edge of the
+// command line arms the UART RX interrupt, the bytes are collected into
+// sio_command_frame, and the rising edge validates the frame (count, framing
+// errors, checksum, timing) before it is handed over to the main loop.
+
+static sio_command_type sio_command_frame;
+static volatile uint8_t sio_command_frame_index;
+static volatile bool sio_command_frame_error;
+static volatile bool sio_command_ready = false;
+static volatile bool sio_command_failed = false;
+static absolute_time_t sio_command_last_byte;
+
+static void uart_rx_irq_handler() {
+	while(uart_is_readable(uart1)) {
+		uint32_t dr = uart_get_hw(uart1)->dr;
+		// Framing, parity, break, or overrun error
+		if((dr & 0xF00) || sio_command_frame_index >= 5)
+			sio_command_frame_error = true;
+		else {
+			((uint8_t *)&sio_command_frame)[sio_command_frame_index++] = (uint8_t)dr;
+			sio_command_last_byte = get_absolute_time();
+		}
+	}
+}
+
+static void command_line_irq_handler() {
+	uint32_t events = gpio_get_irq_event_mask(command_line_pin);
+	if(events & GPIO_IRQ_EDGE_FALL) {
+		gpio_acknowledge_irq(command_line_pin, GPIO_IRQ_EDGE_FALL);
+		sio_command_ready = false;
+		sio_command_frame_index = 0;
+		sio_command_frame_error = false;
+		sio_command_last_byte = nil_time;
+		// Anything received so far is not part of this frame
+		while(uart_is_readable(uart1))
+			(void)uart_get_hw(uart1)->dr;
+		hw_clear_bits(&uart_get_hw(uart1)->rsr, UART_UARTRSR_BITS);
+		uart_set_irq_enables(uart1, true, false);
+	}
+	if(events & GPIO_IRQ_EDGE_RISE) {
+		gpio_acknowledge_irq(command_line_pin, GPIO_IRQ_EDGE_RISE);
+		uart_set_irq_enables(uart1, false, false);
+		uart_rx_irq_handler();
+		// According to Avery's manual the command line should go up 950us
+		// after the last byte at the latest, allow for some more
+		if(!sio_command_frame_error && sio_command_frame_index == 5 &&
+				sio_checksum((uint8_t *)&sio_command_frame, 4) == sio_command_frame.checksum &&
+				sio_command_frame.command_id >= 0x21 &&
+				absolute_time_diff_us(sio_command_last_byte, get_absolute_time()) <= 1250)
+			sio_command_ready = true;
+		else
+			sio_command_failed = true;
+	}
+}
+
+static void init_sio_command_capture() {
+	uart_set_irq_enables(uart1, false, false);
+	irq_set_exclusive_handler(UART1_IRQ, uart_rx_irq_handler);
+	irq_set_enabled(UART1_IRQ, true);
+	gpio_add_raw_irq_handler(command_line_pin, command_line_irq_handler);
+	gpio_set_irq_enabled(command_line_pin, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true);
+	irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+// HSIO divisor auto-tuning, the frames received at high speed are counted
+// per the HSIO option in windows of HSIO_AUTO_WINDOW frames, too many errors
+// within the window make the tuning step down to the next slower divisor.
+// Clean windows make it try the next faster one on probation, a single error
+// there steps back and the next try waits for twice as many clean windows.
+// The change is only made once the response to the current command is out.
+
+static uint8_t hsio_frames[hsio_auto_index_max+1];
+static uint8_t hsio_errors[hsio_auto_index_max+1];
+static bool hsio_error_pending = false;
+static bool hsio_probation = false;
+static uint8_t hsio_clean_windows = 0;
+static uint8_t hsio_up_windows = 1;
+static uint8_t hsio_auto_next = 0; // the divisor to change to, 0 for none
+
+static uint8_t get_hsio_option() {
+	uint8_t s = current_options[hsio_option_index];
+	return s == hsio_option_auto ? hsio_auto_index[current_options[clock_option_index]] : s;
+}
+
+static void set_sio_baudrate(uint8_t s) {
+	uart_set_baudrate(uart1, current_options[clock_option_index] ? hsio_opt_to_baud_ntsc[s] : hsio_opt_to_baud_pal[s]);
+}
+
+static void hsio_auto_record(bool error) {
+	if(current_options[hsio_option_index] != hsio_option_auto || high_speed != 1 || hsio_auto_next)
+		return;
+	uint8_t s = get_hsio_option();
+	hsio_frames[s]++;
+	if(error)
+		hsio_errors[s]++;
+	if(hsio_errors[s] >= (hsio_probation ? 1 : HSIO_AUTO_MAX_ERRORS)) {
+		hsio_frames[s] = 0;
+		hsio_errors[s] = 0;
+		hsio_clean_windows = 0;
+		if(hsio_probation) {
+			// The slower divisor is still the saved one
+			hsio_probation = false;
+			if(hsio_up_windows < HSIO_AUTO_UP_WINDOWS_MAX)
+				hsio_up_windows *= 2;
+			hsio_auto_next = s-1;
+		} else if(s > 1) {
+			hsio_auto_next = s-1;
+			save_hsio_auto_flag = true;
+		}
+	} else if(hsio_frames[s] >= HSIO_AUTO_WINDOW) {
+		bool clean = !hsio_errors[s];
+		hsio_frames[s] = 0;
+		hsio_errors[s] = 0;
+		if(hsio_probation) {
+			hsio_probation = false;
+			hsio_up_windows = 1;
+			save_hsio_auto_flag = true;
+		} else if(!clean)
+			hsio_clean_windows = 0;
+		else if(s < hsio_auto_index_max && ++hsio_clean_windows >= hsio_up_windows) {
+			hsio_clean_windows = 0;
+			hsio_probation = true;
+			hsio_auto_next = s+1;
+		}
+	}
+}
+
+// Drop to the standard speed, the Atari gets the new divisor with the next
+// get speed command
+static void hsio_auto_apply() {
+	if(!hsio_auto_next)
+		return;
+	uart_tx_wait_blocking(uart1);
+	hsio_auto_index[current_options[clock_option_index]] = hsio_auto_next;
+	hsio_auto_next = 0;
+	high_speed = 0;
+	set_sio_baudrate(0);
+}
+
 static bool try_get_sio_command() {
 
 	static uint16_t freshly_changed = 0;
-	bool r = true;
-	int i = 0;
+
+	if(!sio_command_ready && !sio_command_failed)
+		return false;
+
+	uint32_t ints = save_and_disable_interrupts();
+	bool r = sio_command_ready;
+	sio_command_ready = false;
+	sio_command_failed = false;
+	sio_command = sio_command_frame;
+	restore_interrupts(ints);
 
 	// Assumption - when casette motor is on the active command line
 	// is much more likely due to turbo activation and cassette transfer
 	// should not be interrupted. But only when there is a casette mount
 	// and the selected turbo system does make use of the command line pin.
-	if(gpio_get(command_line_pin) || (mounts[0].mounted && !current_options[turbo2_option_index] && gpio_get(normal_motor_pin) == MOTOR_ON_STATE))
+	if(mounts[0].mounted && !current_options[turbo2_option_index] && gpio_get(normal_motor_pin) == MOTOR_ON_STATE)
 		return false;
 
-	memset(&sio_command, 0x01, 5);
-
 	// HiassofT suggests that if bytes == 5 with wrong checksum only or only a single framing error
 	// repeat once without changing the speed
 	// wrong #of bytes, multiple framing errors
-	// continue reading while command line pin is low? When to break this? Let's say after 64?!
 
-	while(!gpio_get(command_line_pin) && i<5 && uart_is_readable_within_us(uart1, serial_read_timeout) && !uart_get_hw(uart1)->rsr)
-		((uint8_t *)&sio_command)[i++] = (uint8_t)uart_get_hw(uart1)->dr;
-
-	//while(!gpio_get(command_line_pin) && uart_is_readable(uart1))
-	//	((uint8_t *)&sio_command)[i] = (uint8_t)uart_get_hw(uart1)->dr;
-	//if(!gpio_get(command_line_pin) && uart_is_readable(uart1))
-	//	((uint8_t *)&sio_command)[i] = (uint8_t)uart_get_hw(uart1)->dr;
-
-	if(gpio_get(command_line_pin) || uart_get_hw(uart1)->rsr || i != 5 ||
-			sio_checksum((uint8_t *)&sio_command, 4) != sio_command.checksum || sio_command.command_id < 0x21) {
-		hw_clear_bits(&uart_get_hw(uart1)->rsr, UART_UARTRSR_BITS);
-		r = false;
-	}
+	// A frame failed at high speed counts against the divisor only when the
+	// Atari gets through at that speed afterwards, otherwise it was the Atari
+	// going back to the standard speed on its own
 
 	if(r) {
-		absolute_time_t t = make_timeout_time_us(1250); // According to Avery's manual 950us
-		while (!gpio_get(command_line_pin) && absolute_time_diff_us(get_absolute_time(), t) > 0)
-			tight_loop_contents();
-		if(!gpio_get(command_line_pin))
-			r = false;
-		else
-			freshly_changed = 0;
-	}else{
+		if(hsio_error_pending)
+			hsio_auto_record(true);
+		hsio_error_pending = false;
+		hsio_auto_record(false);
+		freshly_changed = 0;
+	} else {
+		if(high_speed == 1)
+			hsio_error_pending = true;
 		if(current_options[hsio_option_index] && !freshly_changed && high_speed >= 0) {
 			high_speed ^= 1;
 			// freshly_changed = 2 - high_speed;
 			freshly_changed = 2;
-			uint8_t s = high_speed ? current_options[hsio_option_index] : 0;
-			uart_set_baudrate(uart1, current_options[clock_option_index] ? hsio_opt_to_baud_ntsc[s] : hsio_opt_to_baud_pal[s]);
+			set_sio_baudrate(high_speed ? get_hsio_option() : 0);
 		}else if(freshly_changed)
 			freshly_changed--;
 	}
@@ -159,7 +386,11 @@ static uint8_t check_drive_and_sector_status(int drive_number, FSIZE_t *offset,
 		return 'N';
 	}
 	*offset = sio_command.sector_number-1;
-	if(*offset < 3) {
+	if(disk_headers[drive_number-1].atr_header.sec_size == 512) {
+		// No short boot sectors with 512 byte sectors
+		*to_read = 512;
+		*offset <<= 9;
+	} else if(*offset < 3) {
 		*offset <<= 7;
 		*to_read = 128;
 	} else {
@@ -176,20 +407,57 @@ static uint8_t check_drive_and_sector_status(int drive_number, FSIZE_t *offset,
 	return 'A';
 }
 
+// XF551 high speed commands (command id with bit 7 set) are acknowledged
+// at the standard speed, the rest of the transaction (data frames both ways
+// and the complete status) runs at ~38400 baud, that is the $10 divisor.
+
+static bool xf551_speed_pending = false;
+
+static void xf551_switch_speed() {
+	if(!xf551_speed_pending)
+		return;
+	xf551_speed_pending = false;
+	uart_tx_wait_blocking(uart1);
+	set_sio_baudrate(1);
+}
+
 static uint8_t try_receive_data(int drive_number, FSIZE_t to_read) {
 	int i=0;
 	uint8_t r = 'A';
 	uint8_t status = 0;
-	while(i<to_read && uart_is_readable_within_us(uart1, serial_read_timeout))
-		sector_buffer[i++] = (uint8_t)uart_get_hw(uart1)->dr;
-	if(i != to_read || !uart_is_readable_within_us(uart1, serial_read_timeout) || (uint8_t)uart_get_hw(uart1)->dr != sio_checksum(sector_buffer, to_read)) {
+	uint32_t dr, dr_errors = 0;
+	xf551_switch_speed();
+	while(i<to_read && uart_is_readable_within_us(uart1, serial_read_timeout)) {
+		dr = uart_get_hw(uart1)->dr;
+		dr_errors |= dr;
+		sector_buffer[i++] = (uint8_t)dr;
+	}
+	if(i != to_read || !uart_is_readable_within_us(uart1, serial_read_timeout) || ((dr = uart_get_hw(uart1)->dr) & 0xFF) != sio_checksum(sector_buffer, to_read) || ((dr | dr_errors) & 0xF00)) {
 		status |= 0x02;
 		r = 'N';
 	}
+	hsio_auto_record(r == 'N');
 	disk_headers[drive_number-1].atr_header.temp1 = status;
 	return r;
 }
 
+// A block that has to be played out in full before the next one, false when
+// the ring is still switching to the other state machine, then the loop tries
+// again once it has been drained
+
+static bool cas_block_close_pending = false;
+
+static bool cas_block_close() {
+	if(!pio_enqueue(dma_block_turbo ? pwm_bit : 1, 16))
+		return false;
+	pio_underrun_skip();
+	// If the motor goes off in the meantime the state machine is already
+	// stopped by the motor interrupt, the rest goes out once it is back on
+	while(cas_motor_on() && !pio_sm_is_tx_fifo_empty(cas_pio, dma_block_turbo ? sm_turbo : sm))
+		tight_loop_contents();
+	return true;
+}
+
 void main_sio_loop() {
 	FILINFO fil_info;
 	FSIZE_t offset, to_read;
@@ -198,8 +466,33 @@ void main_sio_loop() {
 	uint bytes_read;
 	absolute_time_t last_sd_check = get_absolute_time();
 	sd_card_t *p_sd = sd_get_by_num(1);
+	init_sio_command_capture();
+	// The tape ring cycle counts on this core
+	pio_cycles_init();
 	while(true) {
 		uint8_t cd_temp = (gpio_get(p_sd->card_detect_gpio) == p_sd->card_detected_true);
+		// Write out anything pending as soon as the card is seen to be going away,
+		// or when the drives are idle for long enough
+		if(disk_cache_dirty()) {
+			mutex_enter_blocking(&mount_lock);
+			if(cd_temp != sd_card_present)
+				disk_cache_flush(-1);
+			else
+				disk_cache_idle();
+			mutex_exit(&mount_lock);
+		}
+		// Boot trace prefetching (or saving) goes in between the commands
+		if(!sio_command_ready && disk_cache_trace_busy()) {
+			mutex_enter_blocking(&mount_lock);
+			disk_cache_trace_step();
+			mutex_exit(&mount_lock);
+		}
+		// So does transcoding of the stopped WAV tape
+		if(!sio_command_ready && wav_cache_busy()) {
+			mutex_enter_blocking(&mount_lock);
+			wav_cache_step();
+			mutex_exit(&mount_lock);
+		}
 		// Debounce 500ms - can it be smaller?
 		if(cd_temp != sd_card_present && absolute_time_diff_us(last_sd_check, get_absolute_time()) > 500000) {
 			last_sd_check = get_absolute_time();
@@ -222,8 +515,10 @@ void main_sio_loop() {
 			cd_temp = 0;
 		if(cd_temp || last_access_error_drive >= 0) {
 			mutex_enter_blocking(&mount_lock);
-			for(i=0; i<5; i++) {
+			for(i=0; i<=DRIVE_COUNT; i++) {
 				if(last_access_error[i] || (cd_temp && mounts[i].mount_path[0] == '1')) {
+					if(i)
+						disk_cache_discard(i);
 					f_close(&mounts[i].fil);
 					mounts[i].status = 0;
 					mounts[i].mounted = false;
@@ -240,57 +535,63 @@ void main_sio_loop() {
 			last_access_error_drive = -1;
 			mutex_exit(&mount_lock);
 		}
-		for(i=0; i<5; i++) {
+		for(i=0; i<=DRIVE_COUNT; i++) {
 			mutex_enter_blocking(&mount_lock);
+			// Give the RAM disk and CAS memory of unmounted drives back
+			if(!mounts[i].mounted) {
+				if(i && disk_cache_release(i) != FR_OK)
+					set_last_access_error(i);
+				else
+					cas_unmount(true);
+			}
 			if(!mounts[i].mounted || mounts[i].status) {
 				mutex_exit(&mount_lock);
 				continue;
 			}
+			// The tape transcoding shares the WAV decoding with the playback
+			if(!i)
+				wav_cache_abort();
 			mutex_enter_blocking(&fs_lock);
 			if(/*f_mount(&fatfs[0], (const char *)mounts[i].mount_path, 1) == FR_OK && */ f_stat((const char *)mounts[i].mount_path, &fil_info) == FR_OK && f_open(&mounts[i].fil, (const char *)mounts[i].mount_path, FA_READ) == FR_OK) {
 				if(!i) {
 					reinit_pio();
-					if(!strcasecmp(&mounts[i].mount_path[strlen(mounts[i].mount_path)-3], "CAS")) {
+					pio_underrun_reset();
+					wav_decode_stop();
+					// A WAV file with a valid transcoded copy in the cache plays that one
+					if(!strcasecmp(&mounts[i].mount_path[strlen(mounts[i].mount_path)-3], "CAS") || wav_cache_open(&mounts[i].fil, &fil_info)) {
 						wav_sample_size = 0;
 						cas_sample_duration = (timing_base_clock+300)/600;
 						cas_size = f_size(&mounts[0].fil);
 						wav_filter_window_size = 0;
+						cas_mount();
 						if(f_read(&mounts[i].fil, &cas_header, sizeof(cas_header_type), &bytes_read) == FR_OK &&
 							bytes_read == sizeof(cas_header_type) &&
 							cas_header.signature == cas_header_FUJI)
 								mounts[i].status = cas_read_forward(cas_header.chunk_length + sizeof(cas_header_type));
+						if(mounts[i].status && cas_seek_chunk >= 0 && cas_chunk_count)
+							mounts[i].status = cas_seek(cas_seek_chunk);
+						cas_seek_chunk = -1;
 					} else {
-						mounts[i].status = 0;
-						if(f_read(&mounts[i].fil, &wav_header, sizeof(wav_header_type), &bytes_read) == FR_OK && bytes_read == sizeof(wav_header_type)) {
-							mounts[i].status = bytes_read;
-							while(wav_header.subchunk2_id != WAV_DATA) {
-								mounts[i].status += wav_header.subchunk2_size;
-								f_lseek(&mounts[i].fil, mounts[i].status);
-								if(f_read(&mounts[i].fil, &wav_header.subchunk2_id, 8, &bytes_read) != FR_OK || bytes_read != 8) {
-									mounts[i].status = 0;
-									break;
-								}
-								mounts[i].status += 8;
-							}
-							if(!mounts[i].status || wav_header.chunk_id != WAV_RIFF || wav_header.format != WAV_WAVE || wav_header.subchunk1_id != WAV_FMT ||
-								wav_header.subchunk1_size != 16 || wav_header.audio_format != 1 || wav_header.byte_rate != wav_header.sample_rate * wav_header.block_align ||
-								wav_header.block_align != (wav_header.bits_per_sample / 8) * wav_header.num_channels) {
-									mounts[i].status = 0;
-							} else {
-								silence_duration = 500; // Extra .5s of silence at the beginning
-								cas_size = mounts[i].status + wav_header.subchunk2_size;
-								cas_block_turbo = current_options[wav_option_index];
-								init_wav();
-							}
+						cas_unmount(false);
+						mounts[i].status = wav_read_header(&mounts[i].fil);
+						if(mounts[i].status) {
+							silence_duration = 500; // Extra .5s of silence at the beginning
+							cas_size = mounts[i].status + wav_header.subchunk2_size;
+							cas_block_turbo = current_options[wav_option_index];
+							init_wav();
+							wav_decode_start();
 						}
 					}
-					cas_last_block_marker = true;
 					if(!mounts[i].status)
 						set_last_access_error(i);
 					else if(last_drive == 0)
 							last_drive = -1;
 				} else {
 					uint8_t disk_type = 0;
+					// Nothing cached for the previous mount is valid any more
+					disk_cache_invalidate(i);
+					if(disk_cache_release(i) != FR_OK)
+						set_last_access_error(i);
 					if(f_read(&mounts[i].fil, sector_buffer, 4, &bytes_read) == FR_OK && bytes_read == 4) {
 						if(*(uint16_t *)sector_buffer == 0x0296) // ATR magic
 							disk_type = disk_type_atr;
@@ -298,22 +599,48 @@ void main_sio_loop() {
 							disk_type = disk_type_xex;
 						else if(*(uint32_t *)sector_buffer == 0x58385441) // AT8X
 							disk_type = disk_type_atx;
+						else if(*(uint32_t *)sector_buffer == cas_header_FUJI)
+							disk_type = disk_type_cas;
 						f_lseek(&mounts[i].fil, 0);
 					}
 					switch(disk_type) {
 						case disk_type_atr:
 							if(f_read(&mounts[i].fil, &disk_headers[i-1].atr_header, sizeof(atr_header_type), &bytes_read) == FR_OK && bytes_read == sizeof(atr_header_type)) {
 								mounts[i].status = (disk_headers[i-1].atr_header.pars | ((disk_headers[i-1].atr_header.pars_high << 16) & 0xFF0000)) << 4;
+								offset = disk_headers[i-1].atr_header.sec_size;
+								if(offset != 128 && offset != 256 && offset != 512) {
+									disk_type = 0;
+									break;
+								}
 								disk_headers[i-1].atr_header.temp2 = 0xFF;
 								if(!current_options[mount_option_index] || (fil_info.fattrib & AM_RDO))
 									disk_headers[i-1].atr_header.flags |= 0x1;
 								disk_headers[i-1].atr_header.temp3 = locate_percom(i);
+								disk_cache_ram_load(i);
+								disk_cache_trace_mount(i);
 							} else
 								disk_type = 0;
 							break;
+						case disk_type_cas:
+							if(!(offset = cas_disk_scan(i))) {
+								disk_type = 0;
+								break;
+							}
+							if(cas_disk_boot[i-1]) {
+								// Single density, the boot records first
+								disk_headers[i-1].atr_header.pars = (offset+127)/128;
+								mounts[i].status = 720*128;
+								disk_headers[i-1].atr_header.sec_size = 128;
+								disk_headers[i-1].atr_header.flags = 0x1;
+								disk_headers[i-1].atr_header.temp2 = 0xFF;
+								disk_headers[i-1].atr_header.temp3 = 0x80;
+								break;
+							}
+							// fall through
 						case disk_type_xex:
 							// Sectors occupied by the file itself
-							offset = f_size(&mounts[i].fil);
+							if(disk_type == disk_type_xex)
+								offset = f_size(&mounts[i].fil);
 							disk_headers[i-1].atr_header.pars = (offset+124)/125;
 							disk_headers[i-1].atr_header.pars_high = offset % 125;
 							if(!disk_headers[i-1].atr_header.pars_high)
@@ -369,12 +696,24 @@ void main_sio_loop() {
 			uint8_t r = 'A';
 			int8_t atx_res;
 			uint64_t us_pre_ce = 300;
-			if(drive_number < 1 || drive_number > 4 || !mounts[drive_number].mounted || last_access_error[drive_number])
+			bool xf551 = false;
+			if(drive_number < 1 || drive_number > DRIVE_COUNT || !mounts[drive_number].mounted || last_access_error[drive_number])
 				goto ignore_sio_command_frame;
+			if(sio_command.command_id & 0x80) {
+				// Only with HSIO enabled, and, like for Ultra Speed, not for ATX,
+				// otherwise these end up NAK-ed as unknown commands
+				if(current_options[hsio_option_index] && disk_headers[drive_number-1].atr_header.temp4 != disk_type_atx &&
+						(sio_command.command_id & 0x7F) != '?') {
+					sio_command.command_id &= 0x7F;
+					xf551 = true;
+					// Already at high speed with Ultra Speed, stay there
+					xf551_speed_pending = (high_speed != 1);
+				}
+			}
 			sleep_us(100); // Needed for BiboDos according to atari_drive_emulator.c
 			gpio_set_function(sio_tx_pin, GPIO_FUNC_UART);
 			memset(sector_buffer, 0, sector_buffer_size);
-			blue_blinks = (high_speed == 1) ? -1 : 0;
+			blue_blinks = (high_speed == 1 || xf551) ? -1 : 0;
 			update_rgb_led(false);
 			update_last_drive(drive_number);
 			disk_headers[drive_number-1].atr_header.temp1 = 0x0;
@@ -397,7 +736,7 @@ void main_sio_loop() {
 						sector_buffer[0] |= 0x20;
 						if(disk_headers[drive_number-1].atr_header.temp3 & 0x03 == 0x03)
 							sector_buffer[0] |= 0x40;
-					} else if(mounts[drive_number].status == 0x20800) // 1040*128
+					} else if(disk_headers[drive_number-1].atr_header.sec_size == 128 && mounts[drive_number].status == 0x20800) // 1040*128
 						sector_buffer[0] |= 0x80; // medium density
 					//} else {
 					//	sector_buffer[1] &= 0x7F; // disk removed
@@ -410,13 +749,15 @@ void main_sio_loop() {
 					if(disk_headers[drive_number-1].atr_header.temp3 & 0x80) {
 						sector_buffer[0] = 1; // # tracks
 						sector_buffer[1] = 3; // step rate
-						offset = disk_headers[i-1].atr_header.sec_size;
+						offset = disk_headers[drive_number-1].atr_header.sec_size;
 						sector_buffer[6] = (offset >> 8) & 0xFF; // bytes / sec high
 						sector_buffer[7] = offset & 0xFF; // bytes / sec low
 						if(offset == 256)
-							offset = 3+(mounts[i].status-384) / offset;
+							offset = 3+(mounts[drive_number].status-384) / offset;
 						else
-							offset = mounts[i].status / offset;
+							offset = mounts[drive_number].status / offset;
+						if(offset > 0xFFFF)
+							offset = 0xFFFF;
 						sector_buffer[2] = (offset >> 8) & 0xFF; // # sectors high
 						sector_buffer[3] = (offset & 0xFF); // # sectors low
 						sector_buffer[4] = 0; // # sides
@@ -436,20 +777,29 @@ void main_sio_loop() {
 							if(r == 'N') break;
 							green_blinks = -1;
 							update_rgb_led(false);
-							if((f_op_stat = mounted_file_transfer(drive_number, sizeof(atr_header_type)+offset, to_read , false)) != FR_OK) {
+							if((f_op_stat = disk_cache_read(drive_number, sio_command.sector_number, sizeof(atr_header_type)+offset, to_read)) != FR_OK) {
 								set_last_access_error(drive_number);
 								disk_headers[drive_number-1].atr_header.temp2 &= 0xEF;
 							}
 							else
 								disk_headers[drive_number-1].atr_header.temp2 = 0xFF;
 							break;
+						case disk_type_cas:
 						case disk_type_xex:
 							r = check_drive_and_sector_status(drive_number, &offset, &to_read);
 							uart_putc_raw(uart1, r);
 							if(r == 'N') break;
 							green_blinks = -1;
 							update_rgb_led(false);
-							if(sio_command.sector_number >= 0x171) {
+							if(disk_headers[drive_number-1].atr_header.temp4 == disk_type_cas && cas_disk_boot[drive_number-1]) {
+								// The sectors past the records stay empty
+								if(offset < disk_headers[drive_number-1].atr_header.pars*128 &&
+										(f_op_stat = cas_disk_read(drive_number, offset, 128)) != FR_OK) {
+									set_last_access_error(drive_number);
+									disk_headers[drive_number-1].atr_header.temp2 &= 0xEF;
+								} else
+									disk_headers[drive_number-1].atr_header.temp2 = 0xFF;
+							} else if(sio_command.sector_number >= 0x171) {
 									offset = (sio_command.sector_number-0x171);
 									if(offset == disk_headers[drive_number-1].atr_header.pars - 1) {
 										to_read = disk_headers[drive_number-1].atr_header.pars_high;
@@ -460,7 +810,11 @@ void main_sio_loop() {
 									}
 									sector_buffer[127] = to_read;
 									offset *= 125;
-									if((f_op_stat = mounted_file_transfer(drive_number, offset, to_read , false)) != FR_OK) {
+									if(disk_headers[drive_number-1].atr_header.temp4 == disk_type_cas)
+										f_op_stat = cas_disk_read(drive_number, offset, to_read);
+									else
+										f_op_stat = mounted_file_transfer(drive_number, offset, to_read , false);
+									if(f_op_stat != FR_OK) {
 										set_last_access_error(drive_number);
 										disk_headers[drive_number-1].atr_header.temp2 &= 0xEF;
 									}else
@@ -574,7 +928,9 @@ void main_sio_loop() {
 								disk_headers[drive_number-1].atr_header.temp1 |= 0x4; // write error
 								set_last_access_error(drive_number);
 							} else if (sio_command.command_id == 'W') {
-								if((f_op_stat = mounted_file_transfer(drive_number, sizeof(atr_header_type)+offset, to_read, false, to_read)) != FR_OK)
+								// The sector goes through to the media and is verified there
+								if((f_op_stat = disk_cache_flush(drive_number)) != FR_OK ||
+										(f_op_stat = disk_cache_read_media(drive_number, sizeof(atr_header_type)+offset, to_read, &sector_buffer[to_read])) != FR_OK)
 									set_last_access_error(drive_number);
 								else if(memcmp(sector_buffer, &sector_buffer[to_read], to_read)) {
 									f_op_stat = FR_INT_ERR;
@@ -641,6 +997,7 @@ void main_sio_loop() {
 						sector_buffer[0] = sector_buffer[1] = 0xFF;
 						break;
 					case disk_type_xex:
+					case disk_type_cas:
 					case disk_type_atx:
 						r = 'N';
 						uart_putc_raw(uart1, r);
@@ -656,7 +1013,7 @@ void main_sio_loop() {
 						r = 'N';
 					uart_putc_raw(uart1, r);
 					if(r == 'N') break;
-					sector_buffer[0] = hsio_opt_to_index[current_options[hsio_option_index]];
+					sector_buffer[0] = hsio_opt_to_index[get_hsio_option()];
 					to_read = 1;
 					break;
 				default:
@@ -667,52 +1024,87 @@ void main_sio_loop() {
 			if(r == 'A') {
 				uart_tx_wait_blocking(uart1);
 				sleep_us(us_pre_ce);
+				xf551_switch_speed();
 				uart_putc_raw(uart1, f_op_stat == FR_OK ? 'C' : 'E');
 				if(to_read) {
 					uart_tx_wait_blocking(uart1);
 					sleep_us(150); // Another one from atari_drive_emulator.c
-					uart_write_blocking(uart1, sector_buffer, to_read);
-					uart_putc_raw(uart1, sio_checksum(sector_buffer, to_read));
+					send_data_frame(to_read);
 				}
 				uart_tx_wait_blocking(uart1);
 				if(sio_command.command_id == '?') {
 					high_speed = 1;
-					r = current_options[hsio_option_index];
-					uart_set_baudrate(uart1, current_options[clock_option_index] ? hsio_opt_to_baud_ntsc[r] : hsio_opt_to_baud_pal[r]);
+					set_sio_baudrate(get_hsio_option());
 				}
 			}
+			if(xf551 && high_speed != 1) {
+				xf551_speed_pending = false;
+				uart_tx_wait_blocking(uart1);
+				set_sio_baudrate(0);
+			}
 ignore_sio_command_frame:
+			hsio_auto_apply();
 			blue_blinks = 0;
 			update_rgb_led(false);
 			mutex_exit(&mount_lock);
-		} else if(mounts[0].mounted && (offset = mounts[0].status) && offset + wav_filter_window_size*wav_header.block_align < cas_size) {
-			// Including wav_sample_size allows for better pre-loading of the decoded WAV data
-			// into the PIO queue, however, it is then more likely to block the whole SIO loop
-			if(/*wav_sample_size || */ cas_motor_on()) {
-				if(wav_sample_size)
-					to_read = std::min((uint32_t)sector_buffer_size, cas_size - offset);
-				else
-					to_read = std::min(cas_header.chunk_length-cas_block_index, (cas_block_turbo ? 128 : 256)*cas_block_multiple);
-				mutex_enter_blocking(&mount_lock);
-				if(!wav_sample_size) {
-					green_blinks = -1;
-					blue_blinks = cas_block_turbo ? -1 : 0;
-					update_rgb_led(false);
+		} else if(mounts[0].mounted && (offset = mounts[0].status) && wav_sample_size && (offset < cas_size || !wav_decode_idle())) {
+			// WAV file, the decoding runs on core0 (wav_decode.cpp), here the data is
+			// read ahead into a free decoding buffer and the decoded pulses go to PIO,
+			// once all of it is decoded and sent the loop is free for other things
+			if(cas_motor_on()) {
+				wav_forward_pulses();
+				if(offset < cas_size && wav_buffer_free()) {
+					to_read = wav_read_size(cas_size - offset);
+					mutex_enter_blocking(&mount_lock);
+					if(mounted_file_transfer(0, offset, to_read, false) != FR_OK)
+						set_last_access_error(0);
+					else {
+						update_last_drive(0);
+						// The filter window at the end of the buffer is read again with the next one
+						mounts[0].status = (offset + to_read < cas_size) ? offset + to_read - wav_data_overlap : cas_size;
+						gpio_set_function(sio_tx_pin, GPIO_FUNC_PIOX);
+						pio_motor_watch();
+						uint8_t silence_bit = (cas_block_turbo ? pwm_bit : 1);
+						while(silence_duration > 0) {
+							uint16_t silence_block_len = silence_duration;
+							if(silence_block_len >= max_clock_ms)
+								silence_block_len = max_clock_ms;
+							pio_enqueue(silence_bit, (timing_base_clock/1000)*silence_block_len);
+							silence_duration -= silence_block_len;
+						}
+						wav_buffer_put(sector_buffer, to_read);
+					}
+					mutex_exit(&mount_lock);
 				}
+			}
+		} else if(mounts[0].mounted && (offset = mounts[0].status) && offset < cas_size) {
+			// CAS file, a block for the other state machine waits (with the loop
+			// serving the commands) until the ring has been drained to this one
+			if(cas_motor_on() && !pio_ring_switching()) {
+				if(cas_block_close_pending) {
+					mutex_enter_blocking(&mount_lock);
+					cas_block_close_pending = !cas_block_close();
+					mutex_exit(&mount_lock);
+					continue;
+				}
+				to_read = std::min(cas_header.chunk_length-cas_block_index, (cas_block_turbo ? 128 : 256)*cas_block_multiple);
+				mutex_enter_blocking(&mount_lock);
+				green_blinks = -1;
+				blue_blinks = cas_block_turbo ? -1 : 0;
+				update_rgb_led(false);
 				if(mounted_file_transfer(0, offset, to_read, false) != FR_OK) {
 					set_last_access_error(0);
 					mutex_exit(&mount_lock);
-					if(!wav_sample_size) {
-						green_blinks = 0;
-						blue_blinks = 0;
-						update_rgb_led(false);
-					}
+					green_blinks = 0;
+					blue_blinks = 0;
+					update_rgb_led(false);
 					continue;
 				}
 				update_last_drive(0);
 				offset += to_read;
-				mounts[0].status = offset - wav_filter_window_size*wav_header.block_align;
+				mounts[0].status = offset;
 				gpio_set_function(sio_tx_pin, GPIO_FUNC_PIOX);
+				pio_motor_watch();
 				uint8_t silence_bit = (cas_block_turbo ? pwm_bit : 1);
 				while(silence_duration > 0) {
 					uint16_t silence_block_len = silence_duration;
@@ -721,156 +1113,59 @@ ignore_sio_command_frame:
 					pio_enqueue(silence_bit, (timing_base_clock/1000)*silence_block_len);
 					silence_duration -= silence_block_len;
 				}
-				if(wav_sample_size) {
-					// WAV file
-					// The first alternative seems to work better - push the data to PIO if there was no action (silence block)
-					// when decoding the last WAV sample block
-					if(!cas_last_block_marker) {
-					//if(wav_last_count > wav_silence_threshold) {
-						uint32_t wav_scaled_bit_duration = wav_sample_div*wav_last_count*wav_scaled_sample_rate/wav_header.sample_rate;
-						wav_last_count = 0;
-						pio_enqueue(cas_fsk_bit, wav_scaled_bit_duration*cas_sample_duration);
-						if(cas_fsk_bit == wav_last_duration_bit)
-							wav_last_duration += wav_scaled_bit_duration;
-						else {
-							wav_last_duration_bit = cas_fsk_bit;
-							wav_last_duration = 0;
-						}
-					}
-					cas_last_block_marker = false;
-					offset = 0;
-					while(offset + wav_filter_window_size*wav_header.block_align < to_read) {
-						int32_t g1, g2;
-						int16_t wav_last_sample = 0;
-						if(wav_sample_size == 2) {
-							int16_t *v = (int16_t *)&sector_buffer[offset+2*(wav_header.num_channels-1)];
-							if(!cas_block_turbo) {
-								g1 = goertzel_int16(v, zcoeff1);
-								g2 = goertzel_int16(v, zcoeff2);
-							}
-							wav_last_sample = *v;
-						}else{
-							int8_t *v = (int8_t *)&sector_buffer[offset+(wav_header.num_channels-1)];
-							if(!cas_block_turbo) {
-								g1 = goertzel_int8(v, zcoeff1);
-								g2 = goertzel_int8(v, zcoeff2);
-							}
-							wav_last_sample = *v * 256;
-						}
-						if(cas_block_turbo) {
-							int16_t ns = 20*filter1(filter2(wav_last_sample));
-
-							if (pwm_bit)
-								pwm_bit = ns >= wav_prev_sample - 200;
-							else
-								pwm_bit = ns > wav_prev_sample + 200;
-							wav_prev_sample = ns;
-						} else {
-							//if(wav_last_sample >= -1000 && wav_last_sample <= 1000)
-							if(wav_last_sample >= -3200 && wav_last_sample <= 3200)
-								wav_last_silence++;
-							else
-								wav_last_silence = 0;
-							pwm_bit = (wav_last_silence > wav_silence_threshold) ? 1 : (filter_avg(g2-g1) > 0);
-						}
-
-						offset += wav_sample_div*wav_header.block_align;
-
-						if(pwm_bit == cas_fsk_bit)
-							wav_last_count++;
-						else {
-							uint32_t wav_scaled_bit_duration = wav_sample_div*wav_last_count*wav_scaled_sample_rate/wav_header.sample_rate;
-							// The first alternative filters stray signal flips in the long steady signal blocks
-							if((cas_block_turbo || wav_last_duration < 1500 || wav_scaled_bit_duration > 10 || wav_last_duration_bit) && wav_scaled_bit_duration) {
-							//if(wav_scaled_bit_duration) {
-								pio_enqueue(cas_fsk_bit, wav_scaled_bit_duration*cas_sample_duration);
-								if(cas_fsk_bit == wav_last_duration_bit)
-									wav_last_duration += wav_scaled_bit_duration;
-								else {
-									wav_last_duration_bit = cas_fsk_bit;
-									wav_last_duration = 0;
-								}
-							}
-							cas_last_block_marker = true;
-							cas_fsk_bit = pwm_bit;
-							wav_last_count = 1;
-						}
-					}
-				} else {
-					// CAS file
-					cas_block_index += to_read;
-					int bs, be, bd;
-					uint8_t b;
-					uint16_t ld;
-					for(i=0; i < to_read; i += cas_block_multiple) {
-						switch(cas_header.signature) {
-							case cas_header_data:
-								pio_enqueue(0, cas_sample_duration);
-								b = sector_buffer[i];
-								for(int j=0; j!=8; j++) {
-									pio_enqueue(b & 0x1, cas_sample_duration);
-									b >>= 1;
-								}
-								pio_enqueue(1, cas_sample_duration);
-								break;
-							case cas_header_fsk:
-							case cas_header_pwml:
-								ld = *(uint16_t *)&sector_buffer[i];
-								// ld = (sector_buffer[i] & 0xFF) | ((sector_buffer[i+1] << 8) & 0xFF00);
-								if(ld != 0)
-									pio_enqueue(cas_fsk_bit, (cas_block_turbo ? pwm_sample_duration : (timing_base_clock/10000))*ld);
-								cas_fsk_bit ^= 1;
-								break;
-							case cas_header_pwmc:
-								ld = (sector_buffer[i+1] & 0xFF) | ((sector_buffer[i+2] << 8) & 0xFF00);
-								for(uint16_t j=0; j<ld; j++) {
-									pio_enqueue(pwm_bit, sector_buffer[i]*pwm_sample_duration/2);
-									pio_enqueue(pwm_bit^1, sector_buffer[i]*pwm_sample_duration/2);
-								}
-								break;
-							case cas_header_pwmd:
-								b = sector_buffer[i];
-								if (pwm_bit_order) {
-									bs=7; be=-1; bd=-1;
-								} else {
-									bs=0; be=8; bd=1;
-								}
-								for(int j=bs; j!=be; j += bd) {
-									uint8_t d = cas_header.aux.aux_b[(b >> j) & 0x1];
-									pio_enqueue(pwm_bit, d*pwm_sample_duration/2);
-									pio_enqueue(pwm_bit^1, d*pwm_sample_duration/2);
-								}
-							default:
-								break;
-						}
-					}
-					if(offset == cas_size) {
-						pio_enqueue(cas_block_turbo ? pwm_bit : 1, 16);
-					}
-					else if(cas_block_index == cas_header.chunk_length && offset < cas_size && mounts[0].mounted) {
-						mutex_enter_blocking(&fs_lock);
-						offset = cas_read_forward(offset);
-						mutex_exit(&fs_lock);
-						mounts[0].status = offset;
-						if(!offset)
-							set_last_access_error(0);
-						else if(cas_header.signature == cas_header_pwmc || cas_header.signature == cas_header_data || silence_duration || dma_block_turbo^cas_block_turbo) {
-							pio_enqueue(dma_block_turbo ? pwm_bit : 1, 16);
-							while(!pio_sm_is_tx_fifo_empty(cas_pio, dma_block_turbo ? sm_turbo : sm))
-								tight_loop_contents();
-							// This is to account for the possible motor off switching lag
-							sleep_ms(MOTOR_CHECK_INTERVAL_MS);
-						}
+				cas_block_index += to_read;
+				uint16_t ld;
+				for(i=0; i < to_read; i += cas_block_multiple) {
+					switch(cas_header.signature) {
+						case cas_header_data:
+							pio_enqueue_byte(sector_buffer[i], cas_sample_duration);
+							break;
+						case cas_header_fsk:
+						case cas_header_pwml:
+							ld = *(uint16_t *)&sector_buffer[i];
+							// ld = (sector_buffer[i] & 0xFF) | ((sector_buffer[i+1] << 8) & 0xFF00);
+							if(ld != 0)
+								pio_enqueue(cas_fsk_bit, (cas_block_turbo ? pwm_sample_duration : (timing_base_clock/10000))*ld);
+							cas_fsk_bit ^= 1;
+							break;
+						case cas_header_pwmc:
+							ld = (sector_buffer[i+1] & 0xFF) | ((sector_buffer[i+2] << 8) & 0xFF00);
+							pio_enqueue_pairs(pwm_bit, sector_buffer[i]*pwm_sample_duration/2, ld);
+							break;
+						case cas_header_pwmd:
+							pio_enqueue_pwm_byte(pwm_bit, sector_buffer[i],
+								cas_header.aux.aux_b[0]*pwm_sample_duration/2, cas_header.aux.aux_b[1]*pwm_sample_duration/2, pwm_bit_order);
+						default:
+							break;
 					}
-					blue_blinks = 0;
-					green_blinks = 0;
-					update_rgb_led(false);
 				}
-			}
-			mutex_exit(&mount_lock);
-		}else if(create_new_file > 0 && last_drive == -1)
+				if(offset == cas_size) {
+					pio_enqueue(cas_block_turbo ? pwm_bit : 1, 16);
+				}
+				else if(cas_block_index == cas_header.chunk_length && offset < cas_size && mounts[0].mounted) {
+					mutex_enter_blocking(&fs_lock);
+					offset = cas_read_forward(offset);
+					mutex_exit(&fs_lock);
+					mounts[0].status = offset;
+					if(!offset)
+						set_last_access_error(0);
+					else if(cas_header.signature == cas_header_pwmc || cas_header.signature == cas_header_data || silence_duration || dma_block_turbo^cas_block_turbo)
+						cas_block_close_pending = !cas_block_close();
+				}
+				blue_blinks = 0;
+				green_blinks = 0;
+				update_rgb_led(false);
+				mutex_exit(&mount_lock);
+			} else
+				cas_time_scan();
+		}
+#ifdef TAPE_CALIBRATION
+		else if(pin_capture_state == pin_capture_requested)
+			pin_capture_run();
+#endif
+		else if(create_new_file > 0 && last_drive == -1)
 			create_new_file = create_new_disk_image();
-		else if(last_drive == -1)
+		else if(last_drive == -1 && !cas_time_scan())
 			check_and_save_config();
 	}
 }
@@ -0,0 +1,391 @@
+/*
+ * This file is part of the a8-pico-sio project --
+ * An Atari 8-bit SIO drive and (turbo) tape emulator for
+ * Raspberry Pi Pico, see
+ *
+ *         https://github.com/woj76/a8-pico-sio
+ *
+ * For information on what / whose work it is based on, check the corresponding
+ * source files and the README file. This file is licensed under GNU General
+ * Public License 3.0 or later.
+ *
+ * Copyright (C) 2025 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+ */
+
+#include "wav_cache.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+
+#include "mounts.hpp"
+#include "file_load.hpp"
+#include "options.hpp"
+#include "io.hpp"
+#include "wav_decode.hpp"
+
+#ifdef WAV_CACHE
+
+// The WAV transcoding cache. While the tape is stopped the WAV file in C: is
+// decoded once more, with the same decoding pipeline as the playback, and the
+// pulses are written as a CAS image into the hidden cache directory next to
+// the WAV file: fsk chunks in 0.1ms units for the standard tapes, pwml ones in
+// the samples of a pwms chunk for the turbo ones. A stretch of the idle level
+// longer than WAV_CACHE_GAP_MS becomes the gap of the next chunk. The FUJI
+// chunk holds the key (the WAV file size, time stamp, and the options the
+// decoding depends on), it is only written once the image is complete.
+
+#define cache_dir_name "WAVCACHE"
+#define cache_key_size 32
+#define cache_buffer_size 512
+#define cache_chunk_max 65534
+
+static volatile bool wav_cache_request = false;
+static bool cache_running = false;
+static bool cache_failed;
+static char cache_wav_path[MAX_PATH_LEN];
+static char cache_dir[MAX_PATH_LEN+16];
+static char cache_path[MAX_PATH_LEN+16];
+static char cache_key[cache_key_size];
+static FIL cache_wav_fil;
+static FIL cache_fil;
+static FSIZE_t cache_offset;
+static FSIZE_t cache_end;
+
+static uint8_t cache_buffer[cache_buffer_size];
+static uint32_t cache_buffer_used;
+static FSIZE_t cache_written;
+static FSIZE_t cache_chunk_offset;
+static uint32_t cache_chunk_length;
+static uint8_t cache_level;
+static uint8_t cache_silence_bit;
+static uint32_t cache_unit;
+static int64_t cache_rest;
+static uint32_t cache_ints;
+
+// The FLASH volume needs the other core locked out for writing
+static void cache_lock() {
+	mutex_enter_blocking(&fs_lock);
+	if(cache_path[0] == '0') {
+		cache_ints = save_and_disable_interrupts();
+		multicore_lockout_start_blocking();
+	}
+}
+
+static void cache_unlock() {
+	if(cache_path[0] == '0') {
+		multicore_lockout_end_blocking();
+		restore_interrupts(cache_ints);
+	}
+	mutex_exit(&fs_lock);
+}
+
+// The cache directory and the CAS file name for the WAV file, false if
+// the path is too long
+static bool cache_make_path(const char *path) {
+	const char *name = strrchr(path, '/');
+	if(!name)
+		return false;
+	name++;
+	size_t l = name - path;
+	size_t n = strlen(name);
+	if(n < 4 || l + strlen(cache_dir_name) + 1 + n + 1 > sizeof(cache_path))
+		return false;
+	memcpy(cache_dir, path, l);
+	strcpy(&cache_dir[l], cache_dir_name);
+	strcpy(cache_path, cache_dir);
+	l = strlen(cache_path);
+	cache_path[l++] = '/';
+	memcpy(&cache_path[l], name, n-3);
+	strcpy(&cache_path[l+n-3], "CAS");
+	return true;
+}
+
+static void cache_make_key(char *key, FILINFO *fil_info) {
+	snprintf(key, cache_key_size, "WAV %08lX %04X%04X %u%u", (unsigned long)fil_info->fsize,
+		fil_info->fdate, fil_info->ftime, current_options[wav_option_index], current_options[clock_option_index]);
+}
+
+// Called on the tape (re)start with both the mount and the file system lock
+// held and the WAV file open. If there is a complete CAS copy for it, the
+// file is swapped for the copy. Otherwise the WAV file gets transcoded the
+// next time the tape is stopped.
+bool wav_cache_open(FIL *fil, FILINFO *fil_info) {
+	FIL f;
+	cas_header_type h;
+	char key[cache_key_size];
+	char saved_key[cache_key_size];
+	uint bytes_read;
+	bool valid = false;
+
+	if(!cache_make_path(mounts[0].mount_path))
+		return false;
+	cache_make_key(key, fil_info);
+	if(f_open(&f, cache_path, FA_READ) == FR_OK) {
+		valid = f_read(&f, &h, sizeof(cas_header_type), &bytes_read) == FR_OK && bytes_read == sizeof(cas_header_type) &&
+			h.signature == cas_header_FUJI && h.chunk_length == strlen(key) &&
+			f_read(&f, saved_key, h.chunk_length, &bytes_read) == FR_OK && bytes_read == h.chunk_length &&
+			!memcmp(saved_key, key, h.chunk_length);
+		f_close(&f);
+	}
+	if(valid) {
+		f_close(fil);
+		if(f_open(fil, cache_path, FA_READ) == FR_OK)
+			return true;
+		f_open(fil, mounts[0].mount_path, FA_READ);
+	}
+	wav_cache_request = true;
+	return false;
+}
+
+static void cache_flush() {
+	uint bytes_written;
+	if(!cache_buffer_used)
+		return;
+	cache_lock();
+	if(f_write(&cache_fil, cache_buffer, cache_buffer_used, &bytes_written) != FR_OK || bytes_written != cache_buffer_used)
+		cache_failed = true;
+	cache_unlock();
+	cache_written += cache_buffer_used;
+	cache_buffer_used = 0;
+}
+
+static void cache_append(const void *data, uint32_t size) {
+	if(cache_buffer_used + size > cache_buffer_size)
+		cache_flush();
+	memcpy(&cache_buffer[cache_buffer_used], data, size);
+	cache_buffer_used += size;
+}
+
+// The length of the current chunk goes into its header, still in the buffer
+// or already in the file
+static void cache_chunk_close() {
+	uint16_t l = cache_chunk_length;
+	uint bytes_written;
+	FSIZE_t o = cache_chunk_offset + 4;
+	if(o >= cache_written) {
+		memcpy(&cache_buffer[o - cache_written], &l, sizeof(uint16_t));
+		return;
+	}
+	cache_lock();
+	if(f_lseek(&cache_fil, o) != FR_OK || f_write(&cache_fil, &l, sizeof(uint16_t), &bytes_written) != FR_OK ||
+			bytes_written != sizeof(uint16_t) || f_lseek(&cache_fil, cache_written) != FR_OK)
+		cache_failed = true;
+	cache_unlock();
+}
+
+static void cache_chunk_start(uint16_t silence) {
+	cas_header_type h;
+	if(cache_chunk_offset)
+		cache_chunk_close();
+	h.signature = cas_block_turbo ? cas_header_pwml : cas_header_fsk;
+	h.chunk_length = 0;
+	h.aux.aux_w = silence;
+	cache_chunk_offset = cache_written + cache_buffer_used;
+	cache_append(&h, sizeof(cas_header_type));
+	cache_chunk_length = 0;
+	// fsk chunks start at 0, pwml ones at the pwms level (0 below)
+	cache_level = 0;
+}
+
+// One duration of the given level, a level that is not the next one in the
+// chunk gets a 0 duration of the other one first
+static void cache_entry(uint8_t b, uint16_t n) {
+	if(cache_chunk_length + 2*sizeof(uint16_t) > cache_chunk_max)
+		cache_chunk_start(0);
+	if(b != cache_level) {
+		uint16_t z = 0;
+		cache_append(&z, sizeof(uint16_t));
+		cache_chunk_length += sizeof(uint16_t);
+	}
+	cache_append(&n, sizeof(uint16_t));
+	cache_chunk_length += sizeof(uint16_t);
+	cache_level = b ^ 1;
+}
+
+// A decoded pulse, the PIO duration is converted to the chunk units with
+// the rounding error carried over, so that the playback time does not drift
+static void cache_pulse(uint8_t b, uint32_t d) {
+	uint32_t ms = d / (timing_base_clock/1000);
+	if(b == cache_silence_bit && ms >= WAV_CACHE_GAP_MS) {
+		cache_chunk_start(ms > 0xFFFF ? 0xFFFF : ms);
+		cache_rest = 0;
+		return;
+	}
+	cache_rest += d;
+	uint32_t n = (cache_rest + cache_unit/2) / cache_unit;
+	if(!n)
+		return;
+	cache_rest -= (int64_t)n*cache_unit;
+	while(n > 0xFFFF) {
+		cache_entry(b, 0xFFFF);
+		n -= 0xFFFF;
+	}
+	cache_entry(b, n);
+}
+
+static void cache_close_wav() {
+	wav_decode_stop();
+	wav_sample_size = 0;
+	mutex_enter_blocking(&fs_lock);
+	f_close(&cache_wav_fil);
+	mutex_exit(&fs_lock);
+}
+
+static void cache_stop(bool complete) {
+	cache_close_wav();
+	cache_running = false;
+	cache_lock();
+	f_close(&cache_fil);
+	if(!complete)
+		f_unlink(cache_path);
+	cache_unlock();
+}
+
+// With the mount lock held
+void wav_cache_abort() {
+	if(cache_running)
+		cache_stop(false);
+}
+
+bool wav_cache_busy() {
+	return wav_cache_request || cache_running;
+}
+
+static void cache_start() {
+	FILINFO fil_info;
+	cas_header_type h;
+	const char *path = mounts[0].mount_path;
+	size_t l = strlen(path);
+	bool ok;
+
+	wav_cache_request = false;
+	if(l < 4 || strcasecmp(&path[l-3], "WAV") || !cache_make_path(path))
+		return;
+	strcpy(cache_wav_path, path);
+	mutex_enter_blocking(&fs_lock);
+	ok = f_stat(path, &fil_info) == FR_OK && f_open(&cache_wav_fil, path, FA_READ) == FR_OK;
+	if(ok && !(cache_offset = wav_read_header(&cache_wav_fil))) {
+		f_close(&cache_wav_fil);
+		ok = false;
+	}
+	mutex_exit(&fs_lock);
+	if(!ok)
+		return;
+	cache_end = cache_offset + wav_header.subchunk2_size;
+
+	wav_decode_stop();
+	cas_block_turbo = current_options[wav_option_index];
+	init_wav();
+	// The sample rate has to fit the pwms chunk
+	if(cas_block_turbo && wav_scaled_sample_rate > 0xFFFF) {
+		cache_close_wav();
+		return;
+	}
+	cache_make_key(cache_key, &fil_info);
+
+	cache_lock();
+	FRESULT r = f_mkdir(cache_dir);
+	if(r == FR_OK)
+		f_chmod(cache_dir, AM_HID, AM_HID);
+	ok = (r == FR_OK || r == FR_EXIST) && f_open(&cache_fil, cache_path, FA_WRITE | FA_CREATE_ALWAYS) == FR_OK;
+	cache_unlock();
+	if(!ok) {
+		cache_close_wav();
+		return;
+	}
+
+	cache_failed = false;
+	cache_running = true;
+	cache_buffer_used = 0;
+	cache_written = 0;
+	cache_chunk_offset = 0;
+	// The key is filled in at the end
+	h.signature = cas_header_FUJI;
+	h.chunk_length = strlen(cache_key);
+	h.aux.aux_w = 0;
+	cache_append(&h, sizeof(cas_header_type));
+	memset(cache_buffer+cache_buffer_used, '-', h.chunk_length);
+	cache_buffer_used += h.chunk_length;
+	if(cas_block_turbo) {
+		uint16_t rate = wav_scaled_sample_rate;
+		h.signature = cas_header_pwms;
+		h.chunk_length = sizeof(uint16_t);
+		h.aux.aux_b[0] = 0b01; // Level 0, LSB first
+		h.aux.aux_b[1] = 0;
+		cache_append(&h, sizeof(cas_header_type));
+		cache_append(&rate, sizeof(uint16_t));
+		cache_unit = cas_sample_duration;
+		cache_silence_bit = 0;
+	} else {
+		cache_unit = timing_base_clock/10000;
+		cache_silence_bit = 1;
+	}
+	// The same lead in as for the playback of the WAV file
+	cache_chunk_start(500);
+	cache_rest = 0;
+	wav_decode_start();
+}
+
+static void cache_finish() {
+	uint bytes_written;
+	cache_chunk_close();
+	cache_flush();
+	cache_lock();
+	if(f_lseek(&cache_fil, sizeof(cas_header_type)) != FR_OK ||
+			f_write(&cache_fil, cache_key, strlen(cache_key), &bytes_written) != FR_OK || bytes_written != strlen(cache_key))
+		cache_failed = true;
+	cache_unlock();
+	cache_stop(!cache_failed);
+}
+
+// Called from the SIO loop when there is no command to serve, the caller
+// holds the mount lock. Starts the transcoding once the tape is stopped,
+// then takes the decoded pulses and reads the next WAV data buffer, the
+// playback of the tape (or another tape) drops the unfinished copy.
+void wav_cache_step() {
+	uint8_t b;
+	uint32_t d;
+	uint bytes_read;
+
+	if(!cache_running) {
+		if(!mounts[0].mounted)
+			cache_start();
+		return;
+	}
+	if(mounts[0].mounted || strcmp(mounts[0].mount_path, cache_wav_path)) {
+		cache_stop(false);
+		return;
+	}
+	// About one buffer write at a time
+	for(int i=0; i < cache_buffer_size/4 && wav_pulse_get(&b, &d); i++)
+		cache_pulse(b, d);
+	if(cache_offset + wav_data_overlap < cache_end) {
+		if(wav_buffer_free()) {
+			uint32_t to_read = wav_read_size(cache_end - cache_offset);
+			mutex_enter_blocking(&fs_lock);
+			if(f_lseek(&cache_wav_fil, cache_offset) != FR_OK || f_read(&cache_wav_fil, sector_buffer, to_read, &bytes_read) != FR_OK ||
+					bytes_read != to_read)
+				cache_failed = true;
+			mutex_exit(&fs_lock);
+			if(!cache_failed) {
+				wav_buffer_put(sector_buffer, to_read);
+				cache_offset += to_read - wav_data_overlap;
+			}
+		}
+	} else if(wav_decode_idle())
+		cache_finish();
+	if(cache_failed && cache_running)
+		cache_stop(false);
+}
+
+#else
+
+bool wav_cache_open(FIL *fil, FILINFO *fil_info) { return false; }
+void wav_cache_abort() {}
+bool wav_cache_busy() { return false; }
+void wav_cache_step() {}
+
+#endif
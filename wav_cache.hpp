@@ -0,0 +1,24 @@
+/*
+ * This file is part of the a8-pico-sio project --
+ * An Atari 8-bit SIO drive and (turbo) tape emulator for
+ * Raspberry Pi Pico, see
+ *
+ *         https://github.com/woj76/a8-pico-sio
+ *
+ * For information on what / whose work it is based on, check the corresponding
+ * source files and the README file. This file is licensed under GNU General
+ * Public License 3.0 or later.
+ *
+ * Copyright (C) 2025 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include "ff.h"
+
+bool wav_cache_open(FIL *fil, FILINFO *fil_info);
+void wav_cache_abort();
+bool wav_cache_busy();
+void wav_cache_step();
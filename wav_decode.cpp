@@ -13,6 +13,14 @@
  */
 
 #include <math.h>
+#include <string.h>
+#ifdef __ARM_FEATURE_SIMD32
+#include <arm_acle.h>
+#endif
+
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "pico/time.h"
 
 #include "wav_decode.hpp"
 #include "io.hpp"
@@ -36,35 +44,139 @@ int16_t wav_prev_sample;
 bool wav_filter1_started;
 bool wav_filter2_started;
 
-int16_t zcoeff1;
-int16_t zcoeff2;
-
-int32_t goertzel_int8(int8_t *x, int16_t zcoeff) {
-	int32_t z;
-	int32_t zprev = 0;
-	int32_t zprev2 = 0;
-	int8_t xn;
-	for(int n=0; n<wav_filter_window_size; n += wav_sample_div) {
-		z = (x[n*wav_header.num_channels]<<2) + ((zcoeff*zprev)>>14) - zprev2;
-		zprev2 = zprev;
-		zprev = z;
+// The two FSK tone filters over the wav_filter_window_size window that starts
+// at the current sample. By default the Goertzel filters run over the whole
+// window for every sample (see below). With WAV_SLIDING_TONE_FILTERS the window
+// is slid one tap at a time instead: each tap is multiplied by the tone phasors
+// (from a phase accumulator and a cosine table) and added to the two complex
+// sums, the tap that drops out of the window takes its stored terms away. The
+// sums are exact in integers, so nothing drifts, and the power (the same
+// quantity the Goertzel filter gives, it does not depend on the phase of the
+// window) costs the same for any window size. It is rounded differently than
+// the Goertzel recursion though, so the decoded signal is not the same.
+
+uint32_t wav_filter_taps;
+static int16_t tone_zcoeff[2]; // Q14
+
+#if defined(WAV_SLIDING_TONE_FILTERS)
+
+#define tone_cos_bits 8
+#define tone_taps_max 32
+
+static int16_t tone_cos[1u << tone_cos_bits]; // Q14
+static uint32_t tone_step[2];
+static uint32_t tone_phase[2];
+static int32_t tone_terms[2][2][tone_taps_max];
+static int32_t tone_sums[2][2];
+static uint32_t tone_count;
+static uint32_t tone_index;
+
+static void tone_filters_reset() {
+	memset(tone_sums, 0, sizeof(tone_sums));
+	tone_phase[0] = tone_phase[1] = 0;
+	tone_count = 0;
+	tone_index = 0;
+}
+
+static void tone_filters_add(int32_t x) {
+	for(int b=0; b<2; b++) {
+		uint32_t p = tone_phase[b] >> (32 - tone_cos_bits);
+		int32_t re = x*tone_cos[p];
+		// sin(a) = cos(a - 90 degrees)
+		int32_t im = x*tone_cos[(p - (1u << (tone_cos_bits-2))) & ((1u << tone_cos_bits)-1)];
+		tone_phase[b] += tone_step[b];
+		if(tone_count == wav_filter_taps) {
+			tone_sums[b][0] -= tone_terms[b][0][tone_index];
+			tone_sums[b][1] -= tone_terms[b][1][tone_index];
+		}
+		tone_terms[b][0][tone_index] = re;
+		tone_terms[b][1][tone_index] = im;
+		tone_sums[b][0] += re;
+		tone_sums[b][1] += im;
 	}
-	return (zprev2*zprev2 + zprev*zprev - ((zcoeff*zprev)>>14)*zprev2) >> 5;
+	if(++tone_index == wav_filter_taps)
+		tone_index = 0;
+	if(tone_count < wav_filter_taps)
+		tone_count++;
+}
+
+static int32_t tone_filter_power(int b) {
+	int32_t re = tone_sums[b][0] >> 14;
+	int32_t im = tone_sums[b][1] >> 14;
+	return (re*re + im*im) >> 5;
 }
 
-int32_t goertzel_int16(int16_t *x, int16_t zcoeff) {
-	int32_t z;
-	int32_t zprev = 0;
-	int32_t zprev2 = 0;
-	for(int n=0; n<wav_filter_window_size; n += wav_sample_div) {
-		z = (x[n*wav_header.num_channels]>>6) + ((zcoeff*zprev)>>14) - zprev2;
-		zprev2 = zprev;
-		zprev = z;
+#endif
+
+// The byte offset of the last channel in a sample frame of the buffer being
+// decoded
+static uint32_t wav_channel_offset;
+
+// One filter tap, the last channel of the sample frame at the given offset
+// of the data buffer, scaled to about 10 bits
+static int32_t wav_tone_tap(const uint8_t *data, uint32_t offset) {
+	if(wav_sample_size == 2)
+		return *(int16_t *)&data[offset+wav_channel_offset] >> 6;
+	return *(int8_t *)&data[offset+wav_channel_offset] << 2;
+}
+
+// Both Goertzel filters over the window that starts at the given offset, in
+// one pass over the taps, the rounding of each step is the same as it always
+// was, so the decoding is bit for bit the one of the earlier releases
+static void goertzel_pair(const uint8_t *data, uint32_t offset, uint32_t tap_step, int32_t *g1, int32_t *g2) {
+	int32_t c1 = tone_zcoeff[0], c2 = tone_zcoeff[1];
+	int32_t z1 = 0, z1prev = 0, z2 = 0, z2prev = 0;
+	for(uint32_t k=0; k<wav_filter_taps; k++, offset += tap_step) {
+		int32_t x = wav_tone_tap(data, offset);
+		int32_t z = x + ((c1*z1)>>14) - z1prev;
+		z1prev = z1;
+		z1 = z;
+		z = x + ((c2*z2)>>14) - z2prev;
+		z2prev = z2;
+		z2 = z;
 	}
-	return (zprev2*zprev2 + zprev*zprev - ((zcoeff*zprev)>>14)*zprev2) >> 5;
+	*g1 = (z1prev*z1prev + z1*z1 - ((c1*z1)>>14)*z1prev) >> 5;
+	*g2 = (z2prev*z2prev + z2*z2 - ((c2*z2)>>14)*z2prev) >> 5;
+}
+
+#ifdef WAV_FILTER_CHECK
+// The original filters next to the sliding ones, the samples where the tone
+// decision (after the averaging) comes out different are counted
+volatile uint32_t wav_check_samples;
+volatile uint32_t wav_check_diffs;
+static int32_t wav_check_values[16];
+static int32_t wav_check_sum;
+
+static void wav_filter_check(const uint8_t *data, uint32_t offset, uint32_t tap_step, int32_t d) {
+	int32_t g1, g2;
+	goertzel_pair(data, offset, tap_step, &g1, &g2);
+	uint32_t n = wav_check_samples++;
+	if(n >= 16)
+		wav_check_sum -= wav_check_values[n & 15];
+	wav_check_values[n & 15] = g2-g1;
+	wav_check_sum += g2-g1;
+	if(((n < 16 ? wav_check_sum/(int32_t)(n+1) : wav_check_sum >> 4) > 0) != (d > 0))
+		wav_check_diffs++;
+}
+#endif
+
+// The turbo PWM signal filters, fixed point Q15 with the coefficients adding
+// up to 1.0 (0.4 for the first one), no divisions. With the DSP extension
+// (Pico 2) both products of a filter step are done by one dual 16-bit
+// multiply-accumulate. The filters are recursive, so the samples still go
+// one by one, the results are the same on both paths.
+
+#define filter1_k 13107 // 0.4
+#define filter2_k1 2731 // 1/12
+#define filter2_k2 (32768 - filter2_k1) // 11/12
+
+#ifdef __ARM_FEATURE_SIMD32
+static inline uint32_t pack16(int16_t hi, int16_t lo) {
+	return ((uint32_t)(uint16_t)hi << 16) | (uint16_t)lo;
 }
+#endif
 
-int16_t filter1(int16_t s) {
+static int16_t filter1(int16_t s) {
 	int16_t rs;
 	static int16_t prs;
 	static int16_t ps;
@@ -73,7 +185,11 @@ int16_t filter1(int16_t s) {
 		ps = s;
 		prs = rs;
 	} else {
-		rs = prs*4/10 + (s-ps)*4/10;
+#ifdef __ARM_FEATURE_SIMD32
+		rs = __smlad(pack16(prs, s), pack16(filter1_k, filter1_k), -ps*filter1_k) >> 15;
+#else
+		rs = (prs*filter1_k + s*filter1_k - ps*filter1_k) >> 15;
+#endif
 		ps = s;
 		prs = rs;
 	}
@@ -81,27 +197,41 @@ int16_t filter1(int16_t s) {
 	return rs;
 }
 
-int16_t filter2(int16_t s) {
+static int16_t filter2(int16_t s) {
 	int16_t rs;
 	static int16_t prs;
-	static int16_t ps;
 
 	if(!wav_filter2_started) {
 		rs = s;
 		prs = rs;
 	} else {
-		rs = s*1/12 + prs*11/12;
+#ifdef __ARM_FEATURE_SIMD32
+		rs = __smlad(pack16(prs, s), pack16(filter2_k2, filter2_k1), 0) >> 15;
+#else
+		rs = (s*filter2_k1 + prs*filter2_k2) >> 15;
+#endif
 		prs = rs;
 	}
 	wav_filter2_started = true;
 	return rs;
 }
 
+// The sample count of a signal level scaled to the PIO sample rate, with
+// the precomputed Q16 reciprocal (rounded up, so that whole results do
+// not drop by one)
+static uint32_t wav_duration_scale;
+
+static uint32_t wav_scaled_duration(uint32_t count) {
+	if(count < (1u << 15))
+		return (count*wav_duration_scale) >> 16;
+	return ((uint64_t)count*wav_duration_scale) >> 16;
+}
+
 // Stepping average over the last 16 values
 #define NUM_READS_SH 4
 #define NUM_READS (1u << NUM_READS_SH)
 
-int32_t filter_avg(int32_t s) {
+static int32_t filter_avg(int32_t s) {
 	static int32_t values[NUM_READS];
 	wav_avg_reads++;
 	if(wav_avg_reads > NUM_READS)
@@ -114,6 +244,486 @@ int32_t filter_avg(int32_t s) {
 	return wav_avg_sum >> NUM_READS_SH;
 }
 
+// The IMA and MS ADPCM formats. The blocks are expanded into 16-bit samples of
+// the last channel (only each wav_sample_div-th one, the filters use no more),
+// the samples at the end of a buffer that are still needed for the filter
+// window stay in front of the ones expanded from the next buffer. Both formats
+// code a sample in 4 bits, which cuts the data read from the media to a quarter
+// of the 16-bit PCM one.
+
+#define wav_ms_coefs_max 16
+#define wav_pcm_size (2*sector_buffer_size + 64)
+
+static uint16_t wav_adpcm_block_samples;
+static uint16_t wav_ms_coef_count;
+static int16_t wav_ms_coefs[wav_ms_coefs_max][2];
+static int16_t wav_pcm[wav_pcm_size];
+static uint32_t wav_pcm_length;
+static uint8_t wav_pcm_phase;
+uint32_t wav_data_overlap;
+
+static const int16_t ima_steps[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+	12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t ima_index_steps[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+static const int16_t ms_adapt[16] = {
+	230, 230, 230, 230, 307, 409, 512, 614, 768, 614, 512, 409, 307, 230, 230, 230
+};
+
+static inline int16_t rd16(const uint8_t *p) {
+	return (int16_t)(p[0] | (p[1] << 8));
+}
+
+static inline int32_t clamp16(int32_t s) {
+	return s < -32768 ? -32768 : (s > 32767 ? 32767 : s);
+}
+
+static inline void wav_pcm_put(int32_t s) {
+	if(!wav_pcm_phase && wav_pcm_length < wav_pcm_size)
+		wav_pcm[wav_pcm_length++] = s;
+	if(++wav_pcm_phase == wav_sample_div)
+		wav_pcm_phase = 0;
+}
+
+// The block header gives the first sample and the step index, the data comes
+// in 4 byte groups per channel, the lower nibble first
+static void wav_ima_block(const uint8_t *b, uint32_t n) {
+	uint32_t ch = wav_header.num_channels;
+	uint32_t c = ch-1;
+	if(n < 4*ch)
+		return;
+	int32_t p = rd16(&b[4*c]);
+	int32_t index = b[4*c+2];
+	if(index > 88)
+		index = 88;
+	wav_pcm_put(p);
+	uint32_t k = 1;
+	for(uint32_t o = 4*ch + 4*c; o + 4 <= n; o += 4*ch) {
+		for(int j=0; j<8 && k < wav_adpcm_block_samples; j++, k++) {
+			uint8_t v = (b[o + j/2] >> (4*(j & 1))) & 0xF;
+			int32_t step = ima_steps[index];
+			int32_t d = step >> 3;
+			if(v & 4)
+				d += step;
+			if(v & 2)
+				d += step >> 1;
+			if(v & 1)
+				d += step >> 2;
+			p = clamp16((v & 8) ? p - d : p + d);
+			index += ima_index_steps[v & 7];
+			index = index < 0 ? 0 : (index > 88 ? 88 : index);
+			wav_pcm_put(p);
+		}
+	}
+}
+
+// The block header gives the predictor, the delta, and the first two samples
+// (the older one goes first), the nibbles of the channels follow in turns, the
+// higher nibble first
+static void wav_ms_block(const uint8_t *b, uint32_t n) {
+	uint32_t ch = wav_header.num_channels;
+	uint32_t c = ch-1;
+	if(n < 7*ch)
+		return;
+	uint8_t pi = b[c];
+	if(pi >= wav_ms_coef_count)
+		pi = 0;
+	int32_t c1 = wav_ms_coefs[pi][0];
+	int32_t c2 = wav_ms_coefs[pi][1];
+	int32_t delta = rd16(&b[ch+2*c]);
+	int32_t s1 = rd16(&b[3*ch+2*c]);
+	int32_t s2 = rd16(&b[5*ch+2*c]);
+	wav_pcm_put(s2);
+	wav_pcm_put(s1);
+	uint32_t k = 2;
+	for(uint32_t m = c; 7*ch + m/2 < n && k < wav_adpcm_block_samples; m += ch, k++) {
+		uint8_t v = (b[7*ch + m/2] >> ((m & 1) ? 0 : 4)) & 0xF;
+		int32_t p = (s1*c1 + s2*c2) >> 8;
+		p = clamp16(p + ((v & 8) ? v - 16 : v)*delta);
+		s2 = s1;
+		s1 = p;
+		delta = (ms_adapt[v]*delta) >> 8;
+		if(delta < 16)
+			delta = 16;
+		wav_pcm_put(p);
+	}
+}
+
+static void wav_adpcm_expand(const uint8_t *data, uint32_t length) {
+	uint32_t ba = wav_header.block_align;
+	for(uint32_t o=0; o < length; o += ba) {
+		uint32_t n = (length - o < ba) ? length - o : ba;
+		if(wav_header.audio_format == WAV_FORMAT_IMA_ADPCM)
+			wav_ima_block(&data[o], n);
+		else
+			wav_ms_block(&data[o], n);
+	}
+}
+
+// The WAV data read at once, the ADPCM blocks are read whole
+uint32_t wav_read_size(FSIZE_t left) {
+	uint32_t n = (left < sector_buffer_size) ? left : sector_buffer_size;
+	if(wav_header.audio_format != WAV_FORMAT_PCM && n >= wav_header.block_align)
+		n -= n % wav_header.block_align;
+	return n;
+}
+
+// The WAV decoding pipeline. Core1 reads the data ahead into two buffers (one
+// is filled while the other one is decoded), the decoding runs on core0 in a
+// lowest priority interrupt and puts the pulses into a ring that core1 forwards
+// to the PIO. A timer pends the interrupt, it preempts the UI, so each entry
+// is cut off after a time slice and the decoding resumes on the next tick.
+// Both hand-overs are single producer / single consumer, each counter only
+// grows and is written by one side only.
+
+#define wav_pulse_ring_bits 10
+#define wav_pulse_ring_size (1u << wav_pulse_ring_bits)
+// The bit is in the top bit, the PIO duration below
+#define wav_pulse_duration_mask 0x7FFFFFFFu
+// Ring items left for the pulses split up by pio_enqueue
+#define wav_forward_margin 16
+#define wav_decode_interval_ms 2
+// At most half of the core0 time, wav_decode_load() tells how much of it a file
+// takes
+#define wav_decode_slice_us 1000
+
+static uint8_t wav_buffers[2][sector_buffer_size];
+static uint32_t wav_buffer_length[2];
+static volatile uint32_t wav_buffers_filled = 0; // core1
+static volatile uint32_t wav_buffers_done = 0; // core0
+static uint32_t wav_decode_offset;
+static bool wav_buffer_started;
+
+static uint32_t wav_pulses[wav_pulse_ring_size];
+static volatile uint32_t wav_pulses_head = 0; // core0
+static volatile uint32_t wav_pulses_tail = 0; // core1
+
+// The decoding time and the samples decoded in it, for the last WAV file
+static volatile uint32_t wav_decode_time_us;
+static volatile uint32_t wav_decode_samples;
+
+static volatile bool wav_decode_enabled = false;
+static volatile bool wav_decode_busy = false;
+static uint wav_decode_irq;
+
+static void wav_pulse_put(uint32_t wav_scaled_bit_duration) {
+	uint32_t d = wav_scaled_bit_duration*cas_sample_duration;
+	if(d > wav_pulse_duration_mask)
+		d = wav_pulse_duration_mask;
+	wav_pulses[wav_pulses_head & (wav_pulse_ring_size-1)] = ((uint32_t)cas_fsk_bit << 31) | d;
+	__dmb();
+	wav_pulses_head++;
+	if(cas_fsk_bit == wav_last_duration_bit)
+		wav_last_duration += wav_scaled_bit_duration;
+	else {
+		wav_last_duration_bit = cas_fsk_bit;
+		wav_last_duration = 0;
+	}
+}
+
+// Decodes (the rest of) the oldest filled buffer, false if the pulse ring
+// filled up or the time slice ran out before the end of it
+static bool wav_decode_buffer(uint32_t slice_start) {
+	const uint8_t *data = wav_buffers[wav_buffers_done & 1];
+	uint32_t length = wav_buffer_length[wav_buffers_done & 1];
+	uint32_t tap_step = wav_sample_div*wav_header.block_align;
+	uint32_t window = wav_filter_window_size*wav_header.block_align;
+	uint32_t offset = wav_decode_offset;
+	bool adpcm = (wav_header.audio_format != WAV_FORMAT_PCM);
+
+	if(wav_pulses_head - wav_pulses_tail >= wav_pulse_ring_size)
+		return false;
+	if(adpcm) {
+		// The decoding goes over the expanded samples that follow the ones left
+		// over from the previous buffer (the filter window)
+		if(!wav_buffer_started)
+			wav_adpcm_expand(data, length);
+		data = (const uint8_t *)wav_pcm;
+		length = wav_pcm_length*sizeof(int16_t);
+		tap_step = sizeof(int16_t);
+		window = wav_filter_taps*sizeof(int16_t);
+		wav_channel_offset = 0;
+	} else
+		wav_channel_offset = wav_sample_size*(wav_header.num_channels-1);
+	if(!wav_buffer_started) {
+		// The first alternative seems to work better - push the data to PIO if there was no action (silence block)
+		// when decoding the last WAV sample block
+		if(!cas_last_block_marker) {
+		//if(wav_last_count > wav_silence_threshold) {
+			uint32_t wav_scaled_bit_duration = wav_scaled_duration(wav_last_count);
+			wav_last_count = 0;
+			wav_pulse_put(wav_scaled_bit_duration);
+		}
+		cas_last_block_marker = false;
+#ifdef WAV_SLIDING_TONE_FILTERS
+		// The tone filters slide over the buffer, the window gets all but its
+		// last tap here, each sample below adds the next one
+		if(!cas_block_turbo) {
+			tone_filters_reset();
+			for(uint32_t k=0; k+1 < wav_filter_taps; k++)
+				tone_filters_add(wav_tone_tap(data, k*tap_step));
+		}
+#endif
+		wav_buffer_started = true;
+	}
+	while(offset + window < length) {
+		if(wav_pulses_head - wav_pulses_tail >= wav_pulse_ring_size ||
+				time_us_32() - slice_start >= wav_decode_slice_us) {
+			wav_decode_offset = offset;
+			return false;
+		}
+		int32_t g1, g2;
+		int16_t wav_last_sample = 0;
+		wav_decode_samples++;
+		if(!cas_block_turbo) {
+#ifdef WAV_SLIDING_TONE_FILTERS
+			tone_filters_add(wav_tone_tap(data, offset + (wav_filter_taps-1)*tap_step));
+			g1 = tone_filter_power(0);
+			g2 = tone_filter_power(1);
+#else
+			goertzel_pair(data, offset, tap_step, &g1, &g2);
+#endif
+		}
+		if(wav_sample_size == 2)
+			wav_last_sample = *(int16_t *)&data[offset+wav_channel_offset];
+		else
+			wav_last_sample = *(int8_t *)&data[offset+wav_channel_offset] * 256;
+		if(cas_block_turbo) {
+			int16_t ns = 20*filter1(filter2(wav_last_sample));
+
+			if (pwm_bit)
+				pwm_bit = ns >= wav_prev_sample - 200;
+			else
+				pwm_bit = ns > wav_prev_sample + 200;
+			wav_prev_sample = ns;
+		} else {
+			//if(wav_last_sample >= -1000 && wav_last_sample <= 1000)
+			if(wav_last_sample >= -3200 && wav_last_sample <= 3200)
+				wav_last_silence++;
+			else
+				wav_last_silence = 0;
+			if(wav_last_silence > wav_silence_threshold)
+				pwm_bit = 1;
+			else {
+				int32_t d = filter_avg(g2-g1);
+#ifdef WAV_FILTER_CHECK
+				wav_filter_check(data, offset, tap_step, d);
+#endif
+				pwm_bit = (d > 0);
+			}
+		}
+
+		offset += tap_step;
+
+		if(pwm_bit == cas_fsk_bit)
+			wav_last_count++;
+		else {
+			uint32_t wav_scaled_bit_duration = wav_scaled_duration(wav_last_count);
+			// The first alternative filters stray signal flips in the long steady signal blocks
+			if((cas_block_turbo || wav_last_duration < 1500 || wav_scaled_bit_duration > 10 || wav_last_duration_bit) && wav_scaled_bit_duration)
+			//if(wav_scaled_bit_duration)
+				wav_pulse_put(wav_scaled_bit_duration);
+			cas_last_block_marker = true;
+			cas_fsk_bit = pwm_bit;
+			wav_last_count = 1;
+		}
+	}
+	if(adpcm) {
+		wav_pcm_length -= offset/sizeof(int16_t);
+		memmove(wav_pcm, &wav_pcm[offset/sizeof(int16_t)], wav_pcm_length*sizeof(int16_t));
+	}
+	wav_decode_offset = 0;
+	wav_buffer_started = false;
+	return true;
+}
+
+static void wav_decode_irq_handler() {
+	wav_decode_busy = true;
+	__dmb();
+	if(wav_decode_enabled && wav_sample_size) {
+		uint32_t slice_start = time_us_32();
+		while(wav_buffers_done != wav_buffers_filled && wav_decode_buffer(slice_start)) {
+			__dmb();
+			wav_buffers_done++;
+		}
+		wav_decode_time_us += time_us_32() - slice_start;
+	}
+	wav_decode_busy = false;
+}
+
+static bool wav_decode_timer(struct repeating_timer *t) {
+	if(wav_decode_enabled && wav_buffers_done != wav_buffers_filled)
+		irq_set_pending(wav_decode_irq);
+	return true;
+}
+
+// Core0, before core1 is started
+void init_wav_decode() {
+	static struct repeating_timer tmr;
+	wav_decode_irq = user_irq_claim_unused(true);
+	irq_set_exclusive_handler(wav_decode_irq, wav_decode_irq_handler);
+	irq_set_priority(wav_decode_irq, PICO_LOWEST_IRQ_PRIORITY);
+	irq_set_enabled(wav_decode_irq, true);
+	add_repeating_timer_ms(wav_decode_interval_ms, wav_decode_timer, NULL, &tmr);
+}
+
+// Core1, waits for the decoding in progress to finish and empties the
+// pipeline, the decoding state can then be set up again
+void wav_decode_stop() {
+	wav_decode_enabled = false;
+	__dmb();
+	while(wav_decode_busy)
+		tight_loop_contents();
+	wav_buffers_filled = 0;
+	wav_buffers_done = 0;
+	wav_decode_offset = 0;
+	wav_buffer_started = false;
+	wav_pulses_head = 0;
+	wav_pulses_tail = 0;
+}
+
+// The percentage of the core0 time the decoding of the last WAV file needs to
+// keep up with the playback, it has to stay under the time slice (50%)
+uint32_t wav_decode_load() {
+	uint32_t n = wav_decode_samples;
+	if(!n || !wav_header.sample_rate)
+		return 0;
+	return (uint64_t)wav_decode_time_us*(wav_header.sample_rate/wav_sample_div)/n/10000;
+}
+
+void wav_decode_start() {
+	wav_decode_time_us = 0;
+	wav_decode_samples = 0;
+	__dmb();
+	wav_decode_enabled = true;
+}
+
+bool wav_buffer_free() {
+	return wav_buffers_filled - wav_buffers_done < 2;
+}
+
+void wav_buffer_put(const uint8_t *data, uint32_t length) {
+	uint32_t i = wav_buffers_filled & 1;
+	memcpy(wav_buffers[i], data, length);
+	wav_buffer_length[i] = length;
+	__dmb();
+	wav_buffers_filled++;
+}
+
+// Core1, the next decoded pulse (the PIO duration), false if there is none yet
+bool wav_pulse_get(uint8_t *b, uint32_t *d) {
+	if(wav_pulses_tail == wav_pulses_head)
+		return false;
+	__dmb();
+	uint32_t p = wav_pulses[wav_pulses_tail & (wav_pulse_ring_size-1)];
+	__dmb();
+	wav_pulses_tail++;
+	*b = p >> 31;
+	*d = p & wav_pulse_duration_mask;
+	return true;
+}
+
+// Core1, true when all the buffers handed over are decoded and all the
+// pulses are taken
+bool wav_decode_idle() {
+	if(wav_buffers_done != wav_buffers_filled)
+		return false;
+	__dmb();
+	return wav_pulses_tail == wav_pulses_head;
+}
+
+// Core1, hands the decoded pulses over to the PIO ring as long as it does
+// not have to wait for the room there
+void wav_forward_pulses() {
+	uint8_t b;
+	uint32_t d;
+	while(pio_ring_free() >= wav_forward_margin && wav_pulse_get(&b, &d))
+		pio_enqueue(b, d);
+}
+
+// The extension of the fmt chunk, the block size in samples and for MS ADPCM
+// also the predictor coefficients
+static bool wav_read_fmt_extension(FIL *fil, uint32_t size) {
+	uint bytes_read;
+	uint16_t ext[3]; // extension size, samples per block, number of coefficients
+	if(wav_header.audio_format == WAV_FORMAT_PCM)
+		return true;
+	if(size < 20 || f_read(fil, ext, 4, &bytes_read) != FR_OK || bytes_read != 4)
+		return false;
+	wav_adpcm_block_samples = ext[1];
+	if(wav_header.audio_format == WAV_FORMAT_MS_ADPCM) {
+		if(size < 22 || f_read(fil, &ext[2], 2, &bytes_read) != FR_OK || bytes_read != 2 ||
+				!ext[2] || ext[2] > wav_ms_coefs_max || size < 22 + 4*ext[2] ||
+				f_read(fil, wav_ms_coefs, 4*ext[2], &bytes_read) != FR_OK || bytes_read != 4*ext[2])
+			return false;
+		wav_ms_coef_count = ext[2];
+	}
+	return true;
+}
+
+static bool wav_format_valid() {
+	uint32_t ch = wav_header.num_channels;
+	uint32_t ba = wav_header.block_align;
+	if(!ch || !ba)
+		return false;
+	switch(wav_header.audio_format) {
+		case WAV_FORMAT_PCM:
+			return wav_header.subchunk1_size == 16 && wav_header.byte_rate == wav_header.sample_rate * ba &&
+				ba == (wav_header.bits_per_sample / 8) * ch;
+		case WAV_FORMAT_IMA_ADPCM:
+			return wav_header.bits_per_sample == 4 && ba > 4*ch && ba <= sector_buffer_size &&
+				wav_adpcm_block_samples && wav_adpcm_block_samples <= (ba - 4*ch)*2/ch + 1;
+		case WAV_FORMAT_MS_ADPCM:
+			return wav_header.bits_per_sample == 4 && ba > 7*ch && ba <= sector_buffer_size &&
+				wav_adpcm_block_samples >= 2 && wav_adpcm_block_samples <= (ba - 7*ch)*2/ch + 2;
+		default:
+			return false;
+	}
+}
+
+// Reads and checks the WAV header, the chunks other than fmt before the sample
+// data are skipped. Gives the offset of the sample data, 0 if the file cannot
+// be played.
+FSIZE_t wav_read_header(FIL *fil) {
+	uint bytes_read;
+	uint32_t chunk[2];
+	FSIZE_t offset = 12;
+	bool fmt = false;
+	if(f_read(fil, &wav_header, 12, &bytes_read) != FR_OK || bytes_read != 12 ||
+			wav_header.chunk_id != WAV_RIFF || wav_header.format != WAV_WAVE)
+		return 0;
+	while(true) {
+		if(f_lseek(fil, offset) != FR_OK || f_read(fil, chunk, 8, &bytes_read) != FR_OK || bytes_read != 8)
+			return 0;
+		offset += 8;
+		if(chunk[0] == WAV_DATA) {
+			wav_header.subchunk2_id = chunk[0];
+			wav_header.subchunk2_size = chunk[1];
+			break;
+		}
+		if(chunk[0] == WAV_FMT) {
+			wav_header.subchunk1_id = chunk[0];
+			wav_header.subchunk1_size = chunk[1];
+			if(chunk[1] < 16 || f_read(fil, &wav_header.audio_format, 16, &bytes_read) != FR_OK || bytes_read != 16 ||
+					!wav_read_fmt_extension(fil, chunk[1]))
+				return 0;
+			fmt = true;
+		}
+		// The chunks are padded to even sizes
+		offset += chunk[1] + (chunk[1] & 1);
+	}
+	if(!fmt || !wav_format_valid())
+		return 0;
+	return offset;
+}
+
 void init_wav() {
 	wav_avg_reads = 0;
 	wav_avg_offset = 0;
@@ -124,22 +734,44 @@ void init_wav() {
 	wav_last_silence = 0;
 	wav_last_count = 0;
 	wav_last_duration = 0;
+	cas_last_block_marker = true;
 
-	wav_sample_size = (wav_header.bits_per_sample == 16) ? 2 : 1;
+	// The ADPCM samples are expanded to 16 bits
+	wav_sample_size = (wav_header.audio_format != WAV_FORMAT_PCM || wav_header.bits_per_sample == 16) ? 2 : 1;
 	wav_sample_div = (wav_header.sample_rate > 48000) ? 2 : 1;
 	wav_silence_threshold = wav_header.sample_rate / (wav_sample_div*20); // 32
+	// Computed exactly as they always were, the float to int conversion included
 	float coeff1 = 2.0*cosf(2.0*M_PI*(3995.0*wav_sample_div/(float)wav_header.sample_rate));
 	float coeff2 = 2.0*cosf(2.0*M_PI*(5327.0*wav_sample_div/(float)wav_header.sample_rate));
-	zcoeff1 = coeff1*(1<<14);
-	zcoeff2 = coeff2*(1<<14);
+	tone_zcoeff[0] = coeff1*(1<<14);
+	tone_zcoeff[1] = coeff2*(1<<14);
+#ifdef WAV_SLIDING_TONE_FILTERS
+	for(int i=0; i<(1 << tone_cos_bits); i++)
+		tone_cos[i] = cosf(2.0*M_PI*i/(1 << tone_cos_bits))*(1<<14);
+	// The phase steps per tap (in 1/2^32 of the full turn) for 3995Hz and 5327Hz
+	tone_step[0] = (uint32_t)((3995ull*wav_sample_div << 32)/wav_header.sample_rate);
+	tone_step[1] = (uint32_t)((5327ull*wav_sample_div << 32)/wav_header.sample_rate);
+#endif
+#ifdef WAV_FILTER_CHECK
+	wav_check_samples = 0;
+	wav_check_diffs = 0;
+	wav_check_sum = 0;
+#endif
 
 	wav_filter_window_size = cas_block_turbo ? 0 : (wav_header.sample_rate < 44100 ? 12 : 20*wav_sample_div);
+	wav_filter_taps = wav_filter_window_size / wav_sample_div;
+	// The PCM data buffers overlap by the filter window, the ADPCM ones keep
+	// the samples of it themselves
+	wav_data_overlap = (wav_header.audio_format == WAV_FORMAT_PCM) ? wav_filter_window_size*wav_header.block_align : 0;
+	wav_pcm_length = 0;
+	wav_pcm_phase = 0;
 	if(cas_block_turbo)
 		wav_scaled_sample_rate = wav_header.sample_rate / wav_sample_div;
 	else
 		// The ideal sampling frequency for PAL is 31668(.7), for NTSC 31960(.54)
 		wav_scaled_sample_rate = wav_header.sample_rate < 44100 ? wav_header.sample_rate : (current_options[clock_option_index] ? 31960 : 31668);
 	cas_sample_duration = (timing_base_clock+wav_scaled_sample_rate/2)/wav_scaled_sample_rate;
+	wav_duration_scale = (((uint64_t)wav_sample_div*wav_scaled_sample_rate << 16) + wav_header.sample_rate - 1) / wav_header.sample_rate;
 	pwm_bit = cas_block_turbo ? 0 : 1;
 	cas_fsk_bit = pwm_bit;
 	wav_last_duration_bit = cas_fsk_bit;
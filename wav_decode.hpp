@@ -21,23 +21,23 @@
 
 extern wav_header_type wav_header;
 extern volatile uint8_t wav_sample_size;
-extern uint8_t wav_last_duration_bit;
-extern uint32_t wav_scaled_sample_rate;
-extern uint8_t wav_sample_div;
-extern int16_t wav_prev_sample;
-extern uint32_t wav_last_silence;
-extern uint32_t wav_last_duration;
-extern bool cas_last_block_marker;
 extern uint32_t wav_filter_window_size;
-extern uint32_t wav_last_count;
-extern uint32_t wav_silence_threshold;
-
-extern int16_t zcoeff1;
-extern int16_t zcoeff2;
+extern uint32_t wav_scaled_sample_rate;
+extern uint32_t wav_data_overlap;
+#ifdef WAV_FILTER_CHECK
+extern volatile uint32_t wav_check_samples;
+extern volatile uint32_t wav_check_diffs;
+#endif
 
-int32_t goertzel_int8(int8_t *x, int16_t zcoeff);
-int32_t goertzel_int16(int16_t *x, int16_t zcoeff);
-int16_t filter1(int16_t s);
-int16_t filter2(int16_t s);
-int32_t filter_avg(int32_t s);
 void init_wav();
+void init_wav_decode();
+void wav_decode_stop();
+void wav_decode_start();
+uint32_t wav_decode_load();
+bool wav_buffer_free();
+void wav_buffer_put(const uint8_t *data, uint32_t length);
+bool wav_pulse_get(uint8_t *b, uint32_t *d);
+bool wav_decode_idle();
+void wav_forward_pulses();
+FSIZE_t wav_read_header(FIL *fil);
+uint32_t wav_read_size(FSIZE_t left);